@@ -32,8 +32,19 @@ struct qv_options_t {
 	uint8_t clusters;
     uint8_t uncompressed;
     uint8_t distortion;
+	uint32_t threads;
+	uint8_t fastq;			// Input is a FASTQ file rather than bare quality lines
+	uint8_t range;			// Only decode lines range_start to range_end (1-based, inclusive)
+	uint64_t range_start;
+	uint64_t range_end;
+	uint64_t mem_limit;		// Bytes the encoder may use for the input, 0 to load it all at once
+	uint8_t coder;			// One of QV_CODER_*
+	uint8_t lanes;			// Coder states that consecutive lines are spread over, 1 for a single state
+	uint8_t estimator;		// One of QV_ESTIMATOR_*
 	char *dist_file;
     char *uncompressed_name;
+	char *headers_name;		// Sidecar files used to rebuild FASTQ when decoding
+	char *sequences_name;
 	double ratio;		// Used for parameter to all modes
 	double e_dist;		// Expected distortion as calculated during optimization
 	double cluster_threshold;
@@ -97,6 +108,32 @@ void write_codebook(FILE *fp, struct cond_quantizer_list_t *quantizers);
 void read_codebooks(FILE *fp, struct quality_file_t *info);
 struct cond_quantizer_list_t *read_codebook(FILE *fp, struct quality_file_t *info);
 
+// File header identification, the version is bumped whenever the layout or the adaptive models change
+// (version 6 halves the counts before they leave 16 bits, version 7 widens the coder field,
+// version 8 sizes each tANS table to its context)
+#define QVZ_MAGIC					"QVZ"
+#define QVZ_FORMAT_VERSION			8
+
+// Entropy coders, stored in the header after the version
+#define QV_CODER_ARITH				0
+#define QV_CODER_RANGE				1
+#define QV_CODER_RANS				2
+#define QV_CODER_TANS				3
+#define QV_CODER_BINARY				4
+
+// Adaptive probability estimators for the coders' stats (see update_stats)
+#define QV_ESTIMATOR_COUNT			0
+#define QV_ESTIMATOR_MIXED			1
+#define QV_ESTIMATOR_STATE			2
+
+// The coder byte holds the coder in its low three bits, the estimator in the next two, and
+// the number of interleaved lanes less one above them
+#define QV_CODER_MASK				0x07
+#define QV_ESTIMATOR_SHIFT			3
+#define QV_ESTIMATOR_MASK			0x03
+#define QV_LANES_SHIFT				5
+#define QV_MAX_LANES				8
+
 #define MAX_CODEBOOK_LINE_LENGTH 3366
 #define COPY_Q_TO_LINE(line, q, i, size) for (i = 0; i < size; ++i) { line[i] = q[i] + 33; }
 #define COPY_Q_FROM_LINE(line, q, i, size) for (i = 0; i < size; ++i) { q[i] = line[i] - 33; }
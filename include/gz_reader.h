@@ -0,0 +1,65 @@
+#ifndef _GZ_READER_H_
+#define _GZ_READER_H_
+/**
+ * Background decompression of gzip input. A reader thread inflates the file into a
+ * small ring of chunks that the line indexer consumes as they become ready, so that
+ * inflation overlaps with indexing. BGZF files (and other gzip files whose members
+ * record their compressed size) have their members inflated in parallel
+ */
+
+#include "util.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Uncompressed bytes per chunk handed to the consumer, and chunks in flight, unless the
+// reader is opened with smaller ones
+#define GZ_CHUNK_LEN				(4096*4096)
+#define GZ_RING_SLOTS				4
+
+// Largest BGZF member, compressed or inflated
+#define BGZF_MAX_MEMBER				65536
+
+// BGZF members handed to each worker thread at a time
+#define GZ_MEMBERS_PER_JOB			64
+
+/**
+ * A piece of the uncompressed file. Every chunk except the last ends with a newline,
+ * so lines are never split between chunks. The consumer owns data once it is returned
+ */
+struct gz_chunk_t {
+	char *data;
+	uint64_t len;
+};
+
+struct gz_reader_t {
+	FILE *fp;
+	uint8_t bgzf;				// Members can be located without inflating them
+	uint32_t threads;
+	uint32_t status;
+	uint64_t chunk_len;			// Chunk length aimed for, at most GZ_CHUNK_LEN
+	uint32_t slots;				// Finished chunks that may wait, at most GZ_RING_SLOTS
+
+	// Ring of finished chunks
+	struct gz_chunk_t ring[GZ_RING_SLOTS];
+	uint32_t head;
+	uint32_t count;
+	uint8_t done;
+
+#if defined(LINUX) || defined(__APPLE__)
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t space;
+#endif
+};
+
+// Returns 1 if the file starts with the gzip magic number
+uint32_t is_gzip_file(const char *path);
+
+// Reader interface
+struct gz_reader_t *gz_reader_open(const char *path, uint32_t threads, uint64_t chunk_len, uint32_t slots);
+uint32_t gz_reader_next(struct gz_reader_t *r, struct gz_chunk_t *chunk);
+uint32_t gz_reader_close(struct gz_reader_t *r);
+
+#endif
@@ -2,6 +2,7 @@
 #define _LINES_H_
 
 
+#include <stdio.h>
 #include <stdint.h>
 
 #include "pmf.h"
@@ -10,20 +11,52 @@
 
 // This limits us to chunks that aren't too big to fit into a modest amount of memory at a time
 #define MAX_LINES_PER_BLOCK			1000000
-#define MAX_READS_PER_LINE			1022
-#define READ_LINEBUF_LENGTH			(MAX_READS_PER_LINE+2)
+#define MAX_SYMBOLS_PER_BLOCK		(1 << 28)
+#define MAX_READS_PER_LINE			(1 << 24)
+
+// Reads longer than this share the model of the last modeled column for the rest of their
+// length, so statistics, codebooks and coding contexts stay bounded however long the reads are
+#define MAX_MODEL_COLUMNS			1022
+#define MODEL_COLUMNS(info)			((info)->columns < MAX_MODEL_COLUMNS ? (info)->columns : MAX_MODEL_COLUMNS)
+#define MODEL_COLUMN(column)		((column) < MAX_MODEL_COLUMNS ? (column) : MAX_MODEL_COLUMNS - 1)
+
+// Quality values are stored as printable characters from QUALITY_OFFSET up, and anything
+// outside the QUALITY_SYMBOLS values above it is rejected when the input is indexed
+#define QUALITY_OFFSET				33
+#define QUALITY_SYMBOLS				72
+
+// Input read from a pipe is spilled to a temporary file in pieces of this size, and
+// at most this many of its lines are used to train the clusters and codebooks
+#define STREAM_SPILL_LENGTH			(1024*1024)
+#define STREAM_SAMPLE_LINES			1000000
+
+// A sample is kept in a single block
+#if STREAM_SAMPLE_LINES > MAX_LINES_PER_BLOCK
+#error "STREAM_SAMPLE_LINES must not be more than MAX_LINES_PER_BLOCK"
+#endif
+
+// Encoding under a memory limit (--mem-limit) maps the input a window at a time. A window
+// is a quarter of the limit, but never smaller than this, so that any allowed line fits
+#define MIN_WINDOW_LENGTH			(2*MAX_READS_PER_LINE)
+
+// Slices of a mapped input handed to each page warming thread, for load balance
+#define PAGE_WARM_SLICES_PER_THREAD	4
 
 // Error codes for reading a line block
 #define LF_ERROR_NONE				0
 #define LF_ERROR_NOT_FOUND			1
 #define LF_ERROR_NO_MEMORY			2
 #define LF_ERROR_TOO_LONG			4
+#define LF_ERROR_BAD_FORMAT			8
+#define LF_ERROR_NOT_SUPPORTED		16
+#define LF_ERROR_BAD_SYMBOL			32
 
 /**
  * Points to a single line, which may be a pointer to a file in memory
  */
 struct line_t {
 	uint8_t cluster;		// Assigned cluster ID
+	uint32_t length;		// Number of quality values in this line, at most the file's columns
 	const symbol_t *m_data;	// Pointer to part of mmap'd region, has no offsets applied, do not modify!
 };
 
@@ -32,6 +65,7 @@ struct line_t {
  */
 struct line_block_t {
 	uint32_t count;
+	uint64_t symbols;			// Quality values in all of the lines
 	struct line_t *lines;
 };
 
@@ -41,9 +75,10 @@ struct line_block_t {
 struct cluster_t {
 	// Used to do clustering
 	uint8_t id;					// Cluster ID
-	uint32_t count;				// Number of lines in this cluster
+	uint64_t count;				// Number of lines in this cluster
 	symbol_t *mean;				// Mean values for this cluster
 	uint64_t *accumulator;		// Accumulator for finding a new cluster center
+	uint64_t *coverage;			// Number of lines long enough to reach each column
 
 	// Used after clustering is done
 	struct cond_pmf_list_t *training_stats;
@@ -66,19 +101,95 @@ struct quality_file_t {
 	struct alphabet_t *alphabet;
 	char *path;
 	uint64_t lines;
-	uint32_t columns;
+	uint32_t columns;			// Length of the longest line
+	uint64_t symbols;			// Total quality values over all lines
 	uint32_t block_count;
 	struct line_block_t *blocks;
+	char **buffers;				// Memory holding the lines when they are not mapped from the file
+	uint32_t buffer_count;
+	void *map;					// Mapping of the input file the lines point into, if any
+	uint64_t map_size;
+	uint64_t error_line;		// Input line on which loading failed, counting from 1, or 0
 	uint8_t cluster_count;
+	uint8_t coder;				// Entropy coder for the quality values, one of QV_CODER_*
+	uint8_t lanes;				// Interleaved coder states, rANS and tANS only
+	uint8_t estimator;			// How the adaptive stats learn, one of QV_ESTIMATOR_*
 	struct cluster_list_t *clusters;
 	struct distortion_t *dist;
 	struct qv_options_t *opts;
 	struct well_state_t well;
 };
 
+/**
+ * A mapped input file being faulted in ahead of the indexer, one slice per parallel job
+ */
+struct page_warmer_t {
+	const char *data;
+	uint64_t size;
+	uint64_t slice;				// Bytes per job, a multiple of the page size
+	uint64_t page;
+	char *sink;					// Keeps the page reads from being optimized away
+};
+
+/**
+ * Incremental state for indexing lines from input that arrives a piece at a time.
+ * Pieces may only be split at line boundaries
+ */
+struct line_indexer_t {
+	struct quality_file_t *info;
+	uint8_t fastq;				// Input is FASTQ, only every fourth line is indexed
+	uint8_t record_line;		// Line within the current FASTQ record
+	uint32_t seq_len;			// Length of the current record's sequence
+	uint64_t line_number;		// Input lines seen so far, including FASTQ header lines
+	uint64_t max_lines;
+	const char *next;			// Where the last call to index_lines stopped
+};
+
+/**
+ * Reads an input one window at a time, for encoding without holding the whole file in
+ * memory. Plain files are mapped a window at a time, cut at the last complete line,
+ * while gzip input is read a chunk at a time from a gz_reader_t. A window also ends
+ * after max_lines lines, since each line takes a line_t besides its data. The indexer
+ * carries FASTQ records and line numbers over from one window to the next
+ */
+struct line_window_t {
+	char *path;
+	int fd;
+	uint8_t gzip;
+	struct gz_reader_t *gz;		// Reader for gzip input, until it is used up
+	char *chunk;				// Gzip chunk being indexed, which may be split over several windows
+	uint64_t chunk_len;
+	uint64_t chunk_pos;
+	uint32_t threads;
+	uint64_t file_size;
+	uint64_t offset;			// File offset of the first line not read yet
+	uint64_t window;			// Bytes mapped at a time
+	uint64_t max_lines;			// Lines indexed at most per window
+	uint64_t page;
+	uint8_t fastq;
+	uint8_t done;
+	struct line_indexer_t ix;
+};
+
+// Line indexing
+void init_line_indexer(struct line_indexer_t *ix, struct quality_file_t *info, uint8_t fastq, uint64_t max_lines);
+uint32_t index_lines(struct line_indexer_t *ix, const char *data, const char *end);
+uint32_t finish_line_indexer(struct line_indexer_t *ix);
+
 // Memory management
 uint32_t load_file(const char *path, struct quality_file_t *info, uint64_t max_lines);
+uint32_t load_fastq(const char *path, struct quality_file_t *info, uint64_t max_lines);
+uint32_t load_stream(FILE *fp, struct quality_file_t *info, uint64_t max_lines, uint8_t fastq);
+uint32_t spill_stream(FILE *fp, char *path, size_t path_len);
+uint32_t sample_lines(struct quality_file_t *info, struct quality_file_t *sample, uint64_t count);
 uint32_t alloc_blocks(struct quality_file_t *info);
 void free_blocks(struct quality_file_t *info);
 
+// Windowed input
+uint32_t open_line_windows(struct line_window_t *w, const char *path, uint64_t window, uint64_t max_lines, uint8_t fastq, uint32_t threads);
+uint32_t next_line_window(struct line_window_t *w, struct quality_file_t *info, struct quality_file_t *win);
+uint32_t rewind_line_windows(struct line_window_t *w);
+void close_line_windows(struct line_window_t *w);
+uint32_t scan_line_windows(struct line_window_t *w, struct quality_file_t *info, struct quality_file_t *sample, uint64_t budget);
+
 #endif
@@ -23,6 +23,24 @@
 #define COMPRESSION 0
 #define DECOMPRESSION 1
 
+// Leading zero bits of a 32 bit word, which must not be zero
+#if defined(__GNUC__)
+#define count_leading_zeros(x) ((uint32_t) __builtin_clz(x))
+#else
+static inline uint32_t count_leading_zeros(uint32_t x) {
+	uint32_t n = 0;
+
+	while (!(x & 0x80000000)) {
+		x <<= 1;
+		n += 1;
+	}
+	return n;
+}
+#endif
+
+// Number of bit count classes for coding long read lengths (0 through 32 bits)
+#define LENGTH_CLASSES 33
+
 typedef struct Arithmetic_code_t {
     int32_t scale3;
     
@@ -34,25 +52,235 @@ typedef struct Arithmetic_code_t {
 	uint32_t r;			// Rescaling condition
 }*Arithmetic_code;
 
+/**
+ * Range coder with 64 bit state that moves whole bytes in and out of the stream. A byte
+ * leaves the top of low once it is the same for every value in [low, low+range), and
+ * range is kept at least RANGE_BOTTOM by cutting it short at a RANGE_BOTTOM boundary
+ * rather than propagating a carry into bytes already written
+ */
+typedef struct range_coder_t {
+	uint64_t low;
+	uint64_t range;
+	uint64_t code;			// Decoder only, the stream bytes lined up with low
+}*Range_code;
+
+#define RANGE_TOP		(1ULL << 56)
+#define RANGE_BOTTOM	(1ULL << 48)
+
+// Bin probabilities for the binary coder are the chance of a 0 in BINARY_PROB_BITS bits. A bin
+// learns like a running average of the bits coded in it, and after that moves 1/2^BINARY_ADAPT_SHIFT
+// of the way to each new bit
+#define BINARY_PROB_BITS	16
+#define BINARY_PROB_ONE		(1 << BINARY_PROB_BITS)
+#define BINARY_ADAPT_SHIFT	9
+
+// The binary coder's mode follows counts of each symbol, halved when they pass this total (over the alphabet size)
+#define BINARY_MODE_MAX		1024
+
+struct binary_bin_t {
+	uint16_t prob;
+	uint16_t count;			// Bits coded, up to where the rate stops slowing down
+};
+
+/**
+ * Binarization of one context's symbols for the binary coder. The first bin asks whether
+ * the symbol is the context's mode, the symbol it has seen most, and otherwise the symbol
+ * follows as an escape, one bin per bit on a binary tree. Two symbol contexts need no tree
+ */
+struct binary_model_t {
+	uint16_t mode;
+	uint16_t treeBits;
+	struct binary_bin_t bins[];		// bins[0] for the mode, and the tree's node k at bins[k]
+};
+
+// rANS frequencies add up to RANS_TOTAL, and the state is kept in [RANS_L, 256*RANS_L)
+#define RANS_SCALE_BITS		15
+#define RANS_TOTAL			(1 << RANS_SCALE_BITS)
+#define RANS_L				(1U << 23)
+
+// Symbols coded from each state, and the longest a context goes between model rebuilds
+#define RANS_CHUNK_SYMBOLS	(1 << 16)
+#define RANS_REFRESH_MAX	32
+
+/**
+ * rANS coder over the adaptive stats. rANS codes in the reverse of the order it decodes,
+ * so the encoder records each symbol's scaled range as it goes, and codes the record
+ * backwards every RANS_CHUNK_SYMBOLS symbols. Each chunk starts with the final state
+ * of its encoding, which is where the decoder starts. With several lanes, each symbol
+ * is coded with the state of its lane and the lanes share the chunk's bytes, so the
+ * chunk starts with every lane's final state
+ */
+// The coder's states span TANS_SIZE, enough for the largest alphabet coded (MAX_MODEL_COLUMNS+1 lengths).
+// Each context's table is only as large as the symbols it uses in a block need, with TANS_LOG_EXTRA
+// more bits for precision, but no smaller than TANS_MIN_LOG once it has two symbols
+#define TANS_TABLE_LOG		10
+#define TANS_SIZE			(1 << TANS_TABLE_LOG)
+#define TANS_LOG_EXTRA		2
+#define TANS_MIN_LOG		5
+#define TANS_CHUNK_SYMBOLS	(1 << 16)
+
+/**
+ * Decoding table entries pack, for one state of a table of 1 << log states, the y in
+ * [freq, 2*freq) its symbol was coded from, which gives the state before it, and above
+ * that the symbol itself, if the context's alphabet leaves room for it
+ */
+#define TANS_ENTRY(symbol, y, log)		((uint16_t) (((symbol) << ((log) + 1)) | (y)))
+#define TANS_ENTRY_SYMBOL(e, log)		((e) >> ((log) + 1))
+#define TANS_ENTRY_Y(e, log)			((e) & ((2U << (log)) - 1))
+#define TANS_ENTRY_FITS(card, log)		((card) <= (1U << (15 - (log))))
+
+/**
+ * A context's symbol counts for one block, scaled to add up to 1 << log, with the
+ * tables for coding with them. Symbols that do not occur in the block get no states.
+ * A table smaller than TANS_SIZE works on the top log bits of the shared state, and
+ * the shift low bits below them pass through each symbol untouched. The decoder's
+ * entries share the table's allocation, one load away from the stats
+ */
+struct tans_table_t {
+	uint8_t log;
+	uint8_t shift;				// TANS_TABLE_LOG - log
+	uint16_t *symbols;			// Decoder: symbol of each state, only if the entries have no room for it
+	uint32_t *counts;			// Encoder: the context's symbols in the block, during the counting pass
+	uint16_t *freq;
+	uint16_t *start;			// Encoder: first entry of each symbol in next
+	uint16_t *next;				// Encoder: table state reached by each of a symbol's entries
+	uint16_t decode[];			// Decoder: TANS_ENTRY for each table state, followed by symbols if needed
+};
+
+/**
+ * Semi-static tANS coder. The encoder goes over a block twice: first only counting the
+ * symbols of every context, then coding them with tables built from the counts, which
+ * are stored at the start of the block. Like rANS it codes backwards, a chunk of
+ * TANS_CHUNK_SYMBOLS symbols at a time, and all of the tables share one state per lane
+ */
+typedef struct tans_coder_t {
+	uint8_t counting;		// Encoder is in its first pass
+	uint32_t lanes;
+	uint32_t lane;			// Lane whose state codes the next symbol
+	uint32_t state[QV_MAX_LANES];
+	uint32_t count;			// Encoder: symbols recorded, decoder: symbols left in the chunk
+	struct tans_table_t **tables;	// Encoder only, table, symbol and lane of each recorded symbol
+	uint16_t *symbols;
+	uint8_t *lane_of;
+	uint32_t *bits;			// Encoder only, bits | count << 16 written for each recorded symbol
+}*Tans_code;
+
+typedef struct rans_coder_t {
+	uint32_t lanes;
+	uint32_t lane;			// Lane whose state codes the next symbol
+	uint32_t state[QV_MAX_LANES];
+	uint32_t count;			// Encoder: symbols recorded, decoder: symbols left in the chunk
+	uint32_t *symbols;		// Encoder only, start | freq << 16 for each recorded symbol
+	uint8_t *lane_of;		// Encoder only, lane of each recorded symbol
+	uint8_t *out;			// Encoder only, scratch space for a chunk's bytes
+}*Rans_code;
+
 typedef struct os_stream_t {
 	FILE *fp;
 	uint8_t *buf;
 	uint32_t bufPos;
-	uint8_t bitPos;
+	uint32_t bufLen;
+	uint8_t owned;			// buf is freed with the stream
+	uint64_t acc;			// Bit accumulator, see stream_write_bits and stream_read_bits
+	uint8_t accBits;
 	uint64_t written;
 } *osStream;
 
+/**
+ * A buffer passed between the coder and the stream I/O thread
+ */
+struct os_io_t {
+	FILE *fp;
+	uint8_t *buf;
+	uint64_t len;
+	uint64_t offset;		// File position to read from
+};
+
+/**
+ * Background thread doing the file I/O for a block stream, so that disk latency overlaps
+ * with coding instead of stalling it. A writer writes queued buffers in order and frees
+ * them. A reader is given the list of buffers to read up front and reads ahead through
+ * it. Either way, at most capacity buffers wait in the ring at once
+ */
+struct os_io_thread_t {
+	uint8_t reading;
+	struct os_io_t *ring;
+	uint32_t capacity;
+	uint32_t head;
+	uint32_t count;
+	uint8_t done;
+
+	// Reads still to be made
+	struct os_io_t *reads;
+	uint32_t read_count;
+	uint32_t next_read;
+
+#if defined(LINUX) || defined(__APPLE__)
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t space;
+#endif
+};
+
+// Smallest alphabet that keeps running sums of its counts. Quantizer outputs never reach it,
+// walking their few counts is cheaper than keeping the sums current
+#define STREAM_CUMULATIVE_MIN	QUALITY_SYMBOLS
+
+// Counts are 16 bits, so they are halved before their total can leave 16 bits, even with a step up to 255
+#define STREAM_TOTAL_MAX		((1 << 16) - 256)
+
+// Mixed estimator: a slow part with long memory plus a fast part that follows recent symbols. The
+// two limits and steps together keep the total within 16 bits
+#define MIXED_SLOW_STEP			4
+#define MIXED_SLOW_MAX			60000
+#define MIXED_FAST_STEP			32
+#define MIXED_FAST_MAX			4096
+
+// State estimator: the number of states a context goes through, one per halving of its counts
+#define STATE_COUNT				4
+
+// Stats records are cache line aligned, and their counts padded to whole 128 bit vectors of counts
+#define STREAM_RECORD_ALIGN		64
+#define STREAM_VECTOR_COUNTS	8
+#define STREAM_PADDED(card)		(((card) + STREAM_VECTOR_COUNTS - 1) & ~(STREAM_VECTOR_COUNTS - 1))
+
+/**
+ * Adaptive model for one context. The counts are stored in the record itself, after
+ * the fields the coders read with them, so a small context fits in one cache line.
+ * Counts past alphabetCard are zero up to the padded size. The mixed estimator's fast
+ * counts and then the running sums (for large alphabets) follow the padded counts
+ */
 typedef struct stream_stats_t {
-    uint32_t *counts;
-    uint32_t alphabetCard;
-    uint32_t step;
     uint32_t n;
+    uint32_t alphabetCard;
+    uint16_t step;
+	uint16_t fastN;			// Mixed estimator: total of the fast counts, which are included in counts and n
+	uint8_t estimator;		// One of QV_ESTIMATOR_*
+	uint8_t state;			// State estimator: halvings so far, up to STATE_COUNT-1
+	uint8_t ransAge;		// Symbols coded since ransFreq was last rebuilt
+	uint8_t ransInterval;	// Symbols between rebuilds, doubling up to RANS_REFRESH_MAX
+	uint16_t *cumCounts;	// cumCounts[x] is the total count of the symbols below x, or NULL for small alphabets
+	uint16_t *ransFreq;		// Counts scaled to RANS_TOTAL, built on first use by the rANS coder, then their running sums
+	struct tans_table_t *tans;	// Block's tANS table, or NULL if the context is not used in it
+	struct binary_model_t *binary;	// Bin probabilities, built on first use by the binary coder
+	uint16_t counts[];
 } *stream_stats_ptr_t;
 
+// Running sums of the rANS frequencies, alphabetCard+1 entries after them
+#define RANS_CUM(stats)			((stats)->ransFreq + (stats)->alphabetCard)
+
 typedef struct arithStream_t {
 	stream_stats_ptr_t cluster_stats;
+	stream_stats_ptr_t *length_stats;	// Line lengths, one context per cluster
+	uint8_t length_classes;				// Lengths are coded as a bit count class plus raw bits (long reads)
+	stream_stats_ptr_t bit_stats;		// Fixed, equally likely 0 and 1 for the raw bits
     stream_stats_ptr_t ***stats;
-    Arithmetic_code a;
+	uint8_t coder;						// One of QV_CODER_*
+    Arithmetic_code a;					// Also holds the rescaling condition for the stats
+	Range_code rc;						// Only for QV_CODER_RANGE and QV_CODER_BINARY
+	Rans_code rans;						// Only for QV_CODER_RANS
+	Tans_code tans;						// Only for QV_CODER_TANS
     osStream os;
 }*arithStream;
 
@@ -60,18 +288,223 @@ typedef struct qv_compressor_t{
     arithStream Quals;
 }*qv_compressor;
 
+/**
+ * State for coding a single line block independently of all the others, with its
+ * own coder, stream buffer, adaptive stats and quantizer selection state
+ */
+struct qv_block_t {
+	uint32_t id;
+	uint32_t count;			// Lines in the block
+	qv_compressor qvc;
+	struct well_state_t well;
+	uint32_t skip;			// Decoded lines to drop from the front of the block (range decoding)
+	uint32_t coded_lines;	// Lines coded in the block when decoding, of which only the first count are kept
+	double distortion;
+	uint64_t symbols;		// Quality values coded, for averaging the distortion
+	char *text;				// Quantized lines as text, for -u or decoding
+	uint64_t text_len;
+	uint64_t text_size;		// Allocated size of text
+	uint8_t *coded;			// Coded bytes read from the file when decoding
+	uint64_t coded_len;
+	uint8_t coded_mapped;	// coded points into a mapping of the file rather than its own buffer
+};
+
+/**
+ * A group of consecutive blocks that are coded concurrently, one job per block
+ */
+struct qv_block_batch_t {
+	struct quality_file_t *info;
+	struct qv_block_t *blocks;
+	uint32_t first_block;	// Id of info->blocks[0], when info holds one window of the input
+	uint8_t uncompressed;
+};
+
+/**
+ * One entry of the block index stored in the footer of the file
+ */
+struct qv_block_entry_t {
+	uint64_t first_line;	// Index of the first line coded in the block
+	uint32_t lines;			// Lines in the block
+	uint64_t offset;		// Offset of the first coded byte from the start of the block data
+	uint64_t length;		// Coded length in bytes
+};
+
+/**
+ * Location of every coded block in the file, used for random access and to hand
+ * blocks to the decoder threads
+ */
+struct qv_block_index_t {
+	uint32_t count;
+	uint64_t data_start;	// File position of the first block
+	struct qv_block_entry_t *blocks;
+};
+
+/**
+ * Quantized text output, shared by the decoder and the encoder's -u dump. Whole blocks
+ * of text are passed on as they are, while small pieces such as FASTQ records are first
+ * gathered into OS_STREAM_BUF_LEN buffers. A stream I/O thread writes the buffers in
+ * order, so each is one large write that overlaps with coding
+ */
+struct text_output_t {
+	FILE *fp;
+	struct os_io_thread_t *io;
+	char *buf;				// Buffer being gathered, if any
+	uint32_t pos;
+};
+
+// Pipe buffer requested for text output to a pipe, where the system allows it
+#define TEXT_PIPE_SIZE			(1024*1024)
+
+/**
+ * Encoder state kept between calls to compress_qv_blocks, so that the input can be
+ * coded one window of blocks at a time. Block ids and line numbers carry on from one
+ * window to the next
+ */
+struct qv_encoder_t {
+	FILE *fout;
+	struct text_output_t *uncompressed;
+	struct os_io_thread_t *io;	// Writes the coded blocks
+	struct qv_block_batch_t batch;
+	struct qv_block_index_t index;
+	uint32_t index_size;	// Entries allocated in index.blocks
+	uint64_t first_line;
+	uint64_t bytes_used;
+	uint64_t symbols;
+	double distortion;
+};
+
+/**
+ * Buffered FASTQ record output for the decoder, with the sidecar files that supply
+ * the header and sequence lines
+ */
+struct fastq_output_t {
+	struct text_output_t *out;
+	FILE *headers;
+	FILE *sequences;
+	char *line;				// Scratch space for reading sidecar lines
+	uint32_t line_size;
+};
+
+// Size of one block index entry and of the trailer that closes the file
+#define QV_INDEX_ENTRY_SIZE		28
+#define QV_TRAILER_SIZE			8
+#define QV_TRAILER_MAGIC		"QVZI"
 
 
 
 // Stream interface
 struct os_stream_t *alloc_os_stream(FILE *fp, uint8_t in);
+struct os_stream_t *alloc_os_stream_mem();
+struct os_stream_t *alloc_os_stream_buffer(uint8_t *buf, uint32_t len, uint8_t owned);
 void free_os_stream(struct os_stream_t *);
-uint8_t stream_read_bit(struct os_stream_t *);
-uint32_t stream_read_bits(struct os_stream_t *os, uint8_t len);
-void stream_write_bit(struct os_stream_t *, uint8_t);
-void stream_write_bits(struct os_stream_t *os, uint32_t dw, uint8_t len);
+void stream_refill(struct os_stream_t *os);
+void stream_flush_word(struct os_stream_t *os);
 void stream_finish_byte(struct os_stream_t *);
 void stream_write_buffer(struct os_stream_t *);
+void stream_write_bytes(struct os_stream_t *os, const uint8_t *data, uint32_t len);
+uint8_t stream_read_buffer(struct os_stream_t *os);
+
+/**
+ * Writes up to 32 bits, msb first, to be read back the same way. Bits collect in a 64
+ * bit accumulator, the newest in the low bits, and go to the buffer a 32 bit word at a
+ * time. These are called for every coded bit, so they are kept inline
+ */
+static inline void stream_write_bits(struct os_stream_t *os, uint32_t dw, uint8_t len) {
+	os->acc = (os->acc << len) | (dw & (uint32_t) ((1ULL << len) - 1));
+	os->accBits += len;
+	if (os->accBits >= 32)
+		stream_flush_word(os);
+}
+
+static inline void stream_write_bit(struct os_stream_t *os, uint8_t bit) {
+	stream_write_bits(os, bit, 1);
+}
+
+/**
+ * Reads up to 32 bits written by stream_write_bits. Unread bits wait msb-aligned in the
+ * accumulator, which is refilled up to eight bytes at a time. The buffer itself is
+ * never modified, so it may be a mapping of the file
+ */
+static inline uint32_t stream_read_bits(struct os_stream_t *os, uint8_t len) {
+	uint32_t rtn;
+
+	if (len == 0)
+		return 0;
+	if (os->accBits < len)
+		stream_refill(os);
+	rtn = (uint32_t) (os->acc >> (64 - len));
+	os->acc <<= len;
+	os->accBits -= len;
+	return rtn;
+}
+
+static inline uint8_t stream_read_bit(struct os_stream_t *os) {
+	return (uint8_t) stream_read_bits(os, 1);
+}
+
+/**
+ * Byte at a time access for the range coder, which does not use the bit accumulator
+ */
+static inline void stream_write_byte(struct os_stream_t *os, uint8_t b) {
+	if (os->bufPos == os->bufLen)
+		stream_write_buffer(os);
+	os->buf[os->bufPos] = b;
+	os->bufPos += 1;
+}
+
+static inline uint8_t stream_read_byte(struct os_stream_t *os) {
+	if (os->bufPos < os->bufLen)
+		return os->buf[os->bufPos++];
+	return stream_read_buffer(os);
+}
+
+/**
+ * Shifts out the bytes of low that are settled, and cuts range short when it has
+ * become too small but still spans a RANGE_TOP boundary, so that no carry can reach
+ * a byte once it has been written
+ */
+static inline void range_encoder_normalize(Range_code rc, osStream os) {
+	while (1) {
+		if ((rc->low ^ (rc->low + rc->range)) >= RANGE_TOP) {
+			if (rc->range >= RANGE_BOTTOM)
+				return;
+			rc->range = -rc->low & (RANGE_BOTTOM - 1);
+		}
+		stream_write_byte(os, (uint8_t) (rc->low >> 56));
+		rc->low <<= 8;
+		rc->range <<= 8;
+	}
+}
+
+/**
+ * Same as the encoder, with each shifted out byte replaced by the next byte of input
+ */
+static inline void range_decoder_normalize(Range_code rc, osStream is) {
+	while (1) {
+		if ((rc->low ^ (rc->low + rc->range)) >= RANGE_TOP) {
+			if (rc->range >= RANGE_BOTTOM)
+				return;
+			rc->range = -rc->low & (RANGE_BOTTOM - 1);
+		}
+		rc->code = (rc->code << 8) | stream_read_byte(is);
+		rc->low <<= 8;
+		rc->range <<= 8;
+	}
+}
+
+// Stream I/O thread interface
+struct os_io_thread_t *start_os_writer(uint32_t capacity);
+void os_io_write(struct os_io_thread_t *io, FILE *fp, uint8_t *buf, uint64_t len);
+void os_io_wait(struct os_io_thread_t *io);
+struct os_io_thread_t *start_os_reader(struct os_io_t *reads, uint32_t count, uint32_t capacity);
+uint8_t *os_io_read(struct os_io_thread_t *io, uint64_t *len);
+void stop_os_io(struct os_io_thread_t *io);
+
+// Text output interface
+struct text_output_t *open_text_output(FILE *fp, uint32_t capacity);
+void text_output_block(struct text_output_t *out, char *text, uint64_t len);
+void text_output_append(struct text_output_t *out, const char *data, uint32_t len);
+void close_text_output(struct text_output_t *out);
 
 // Arithmetic ncoder interface
 Arithmetic_code initialize_arithmetic_encoder(uint32_t m);
@@ -80,8 +513,40 @@ int encoder_last_step(Arithmetic_code a, osStream os);
 uint32_t arithmetic_decoder_step(Arithmetic_code a, stream_stats_ptr_t stats, osStream is);
 uint32_t decoder_last_step(Arithmetic_code a, stream_stats_ptr_t stats);
 
+// Range coder interface
+Range_code initialize_range_coder();
+void range_encoder_step(Range_code rc, stream_stats_ptr_t stats, uint32_t x, osStream os);
+int range_encoder_last_step(Range_code rc, osStream os);
+void range_decoder_start(Range_code rc, osStream is);
+uint32_t range_decoder_step(Range_code rc, stream_stats_ptr_t stats, osStream is);
+
+// rANS coder interface
+Rans_code initialize_rans_coder(uint8_t decompressor_flag, uint32_t lanes);
+void free_rans_coder(Rans_code rans);
+void rans_encoder_step(Rans_code rans, stream_stats_ptr_t stats, uint32_t x, osStream os);
+int rans_encoder_last_step(Rans_code rans, osStream os);
+uint32_t rans_decoder_step(Rans_code rans, stream_stats_ptr_t stats, osStream is);
+
+// Binary coder interface, over a range coder
+void binary_encoder_step(Range_code rc, stream_stats_ptr_t stats, uint32_t x, osStream os);
+uint32_t binary_decoder_step(Range_code rc, stream_stats_ptr_t stats, osStream is);
+
+// tANS coder interface
+Tans_code initialize_tans_coder(uint8_t decompressor_flag, uint32_t lanes);
+void free_tans_coder(Tans_code tans);
+void free_tans_table(struct tans_table_t *table);
+void tans_begin_count(arithStream as, struct quality_file_t *info);
+void tans_write_tables(arithStream as, struct quality_file_t *info);
+void tans_read_tables(arithStream as, struct quality_file_t *info);
+void tans_encoder_step(Tans_code tans, stream_stats_ptr_t stats, uint32_t x, osStream os);
+int tans_encoder_last_step(Tans_code tans, osStream os);
+uint32_t tans_decoder_step(Tans_code tans, stream_stats_ptr_t stats, osStream is);
+
 // Encoding stats management
-stream_stats_ptr_t **initialize_stream_stats(struct cond_quantizer_list_t *q_list);
+stream_stats_ptr_t alloc_stream_stats(uint32_t alphabetCard, uint32_t step, uint8_t estimator);
+void free_stream_stat(stream_stats_ptr_t stats);
+stream_stats_ptr_t **initialize_stream_stats(struct cond_quantizer_list_t *q_list, uint8_t estimator);
+void free_stream_stats(stream_stats_ptr_t **s, struct cond_quantizer_list_t *q_list);
 void update_stats(stream_stats_ptr_t stats, uint32_t x, uint32_t r);
 
 // Quality value compression interface
@@ -89,10 +554,23 @@ void compress_qv(arithStream as, uint32_t x, uint8_t cluster, uint32_t column, u
 void qv_write_cluster(arithStream as, uint8_t cluster);
 uint32_t decompress_qv(arithStream as, uint8_t cluster, uint32_t column, uint32_t idx);
 uint8_t qv_read_cluster(arithStream as);
+void qv_write_length(arithStream as, uint8_t cluster, uint32_t length);
+uint32_t qv_read_length(arithStream as, uint8_t cluster);
+
+void initialize_well_seed(FILE *fp, uint8_t decompressor_flag, struct quality_file_t *info);
+arithStream initialize_arithStream(osStream os, uint8_t decompressor_flag, struct quality_file_t *info);
+void free_arithStream(arithStream as, struct quality_file_t *info);
+qv_compressor initialize_qv_compressor(osStream os, uint8_t streamDirection, struct quality_file_t *info);
+void free_qv_compressor(qv_compressor qvc, struct quality_file_t *info);
 
-qv_compressor initialize_qv_compressor(FILE *fout, uint8_t streamDirection, struct quality_file_t *info);
+void write_block_index(FILE *fout, struct qv_block_index_t *index);
+uint32_t read_block_index(FILE *fin, struct qv_block_index_t *index);
+void free_block_index(struct qv_block_index_t *index);
 
-uint32_t start_qv_compression(struct quality_file_t *info, FILE *fout, double *dis, FILE * funcompressed);
-void start_qv_decompression(FILE *fout, FILE *fin, struct quality_file_t *info);
+void begin_qv_compression(struct qv_encoder_t *enc, struct quality_file_t *info, FILE *fout, FILE *funcompressed);
+void compress_qv_blocks(struct qv_encoder_t *enc, struct quality_file_t *info);
+uint64_t finish_qv_compression(struct qv_encoder_t *enc, double *dis);
+uint64_t start_qv_compression(struct quality_file_t *info, FILE *fout, double *dis, FILE * funcompressed);
+void start_qv_decompression(FILE *fout, FILE *fin, struct quality_file_t *info, uint64_t first_line, uint64_t last_line, FILE *fheaders, FILE *fsequences);
 
 #endif
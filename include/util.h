@@ -8,23 +8,32 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <float.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #ifdef LINUX
 	#include <time.h>
+	#include <pthread.h>
+	#include <malloc.h>
+	#include <sys/resource.h>
 	#define _stat stat
 	#define _alloca alloca
 	#define restrict __restrict__
 #elif __APPLE__
     #include <time.h>
+    #include <pthread.h>
+    #include <sys/resource.h>
     #define _stat stat
     #define _alloca alloca
 #else
   #include <malloc.h>
 	#include <windows.h>
 	#define restrict __restrict
+	#define fseeko _fseeki64
+	#define ftello _ftelli64
 #endif
 
 struct hrtimer_t {
@@ -48,6 +57,18 @@ void start_timer(struct hrtimer_t *timer);
 void stop_timer(struct hrtimer_t *timer);
 double get_timer_interval(struct hrtimer_t *timer);
 
+// Cross platform parallel-for interface, runs fn(ctx, job) for every job in [0, jobs)
+// using up to the given number of threads. Jobs are handed out in increasing order
+typedef void (*parallel_job_t)(void *ctx, uint32_t job);
+void run_parallel(parallel_job_t fn, void *ctx, uint32_t jobs, uint32_t threads);
+
+// Cross platform zeroed allocation starting on a multiple of align, a power of two, released with free_aligned()
+void *calloc_aligned(size_t size, size_t align);
+void free_aligned(void *ptr);
+
+// Largest resident set the process has had so far in bytes, 0 where it isn't known
+uint64_t peak_resident_memory();
+
 // ceiling(log2()) function used in bit calculations
 int cb_log2(int x);
 
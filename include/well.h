@@ -16,5 +16,6 @@ struct well_state_t {
 
 uint32_t well_1024a(struct well_state_t *state);
 uint32_t well_1024a_bits(struct well_state_t *state, uint8_t bits);
+void well_1024a_fork(struct well_state_t *out, const struct well_state_t *base, uint32_t stream);
 
 #endif
@@ -2,6 +2,54 @@
 #include <stdio.h>
 #include "qv_compressor.h"
 
+/**
+ * Finds the symbol whose cumulative count range holds target, that is the x with
+ * cumCounts[x] <= target < cumCounts[x+1], for a target below n. Only used for alphabets
+ * large enough to keep running sums, and searched with conditional moves
+ */
+static uint32_t find_stream_symbol(stream_stats_ptr_t stats, uint32_t target) {
+	const uint16_t *above = stats->cumCounts + 1;
+	uint32_t base = 0, len = stats->alphabetCard, half;
+
+	while (len > 1) {
+		half = len >> 1;
+		base = (above[base + half - 1] <= target) ? base + half : base;
+		len -= half;
+	}
+	return base + (above[base] <= target);
+}
+
+/**
+ * Finds the symbol for target by walking the counts, which is cheaper than keeping
+ * running sums current when there are only a few symbols
+ */
+static uint32_t scan_stream_symbol(stream_stats_ptr_t stats, uint32_t target) {
+	uint32_t k = 0, cumCount = 0;
+
+	while (target >= cumCount)
+		cumCount += stats->counts[k++];
+	return k - 1;
+}
+
+/**
+ * Looks up the range [*low, *high) of symbol x
+ */
+static inline void stream_symbol_range(stream_stats_ptr_t stats, uint32_t x, uint32_t *low, uint32_t *high) {
+	uint32_t i, sum = 0;
+
+	if (stats->cumCounts) {
+		*low = stats->cumCounts[x];
+		*high = stats->cumCounts[x+1];
+		return;
+	}
+
+	for (i = 0; i < x; ++i) {
+		sum += stats->counts[i];
+	}
+	*low = sum;
+	*high = sum + stats->counts[x];
+}
+
 Arithmetic_code initialize_arithmetic_encoder(uint32_t m) {
     Arithmetic_code a_code;
     
@@ -9,6 +57,10 @@ Arithmetic_code initialize_arithmetic_encoder(uint32_t m) {
     
     a_code->m = m;
 	a_code->r = 1 << (m - 3);
+
+	// The stats keep 16 bit counts, so they must be halved before the coder would need it
+	if (a_code->r > STREAM_TOTAL_MAX)
+		a_code->r = STREAM_TOTAL_MAX;
     a_code->l = 0;
 	a_code->u = (1 << m) - 1;
     
@@ -20,27 +72,52 @@ Arithmetic_code initialize_arithmetic_encoder(uint32_t m) {
  * been determined and must be sent to the output stream
  * E3 checks for upper being 10xxxx... and lower being 01xxxx... indicating that after rescaling the
  * range we are still in the indetermined central region
+ *
+ * Rather than testing these one bit at a time, every rescaling due after a symbol is done at once.
+ * All of the E1/E2 rescalings come first: they shift out the leading bits on which l and u agree,
+ * which is the leading zero count of l ^ u. That leaves l as 0xxx... and u as 1xxx..., so E1/E2
+ * cannot hold again and the E3 rescalings follow, one for each leading bit after the MSB that is 1
+ * in l and 0 in u. The bits written or read are exactly those of the bit by bit loop
 */
+static inline uint32_t settled_bits(Arithmetic_code a) {
+	// The low bits are set so that l == u counts as all m bits settled
+	return count_leading_zeros(((a->l ^ a->u) << (32 - a->m)) | ((1U << (32 - a->m)) - 1));
+}
+
+static inline uint32_t straddling_bits(Arithmetic_code a) {
+	// Bits below the window shift in as zeros, so the complement is never zero
+	return count_leading_zeros(~((a->l & ~a->u) << (33 - a->m)));
+}
+
+/**
+ * Writes count copies of bit, for the E3 rescalings that were waiting on the next settled bit
+ */
+static void write_pending_bits(osStream os, uint8_t bit, uint32_t count) {
+	uint32_t word = bit ? 0xffffffff : 0;
+
+	while (count >= 32) {
+		stream_write_bits(os, word, 32);
+		count -= 32;
+	}
+	stream_write_bits(os, word, count);
+}
+
 void arithmetic_encoder_step(Arithmetic_code a, stream_stats_ptr_t stats, int32_t x, osStream os) {
     uint64_t range = 0;
-    uint8_t msbU = 0, msbL = 0, E1_E2 = 0, E3 = 0, smsbL = 0, smsbU = 0;
+    uint8_t msbL = 0;
     uint32_t cumCountX, cumCountX_1;
-    int32_t i;
+	uint32_t settled, straddling;
 
 	// These are actually constants, need to lift a->m out of the struct because it is compile-time constant
 	uint32_t msb_shift = a->m - 1;
-	uint32_t smsb_shift = a->m - 2;
 	uint32_t msb_clear_mask = (1 << msb_shift) - 1;
+	uint32_t mask = (1 << a->m) - 1;
     
     range = a->u - a->l + 1;
 
 	assert(x < stats->alphabetCard);
     
-	cumCountX_1 = 0;
-	for (i = 0; i < x; ++i) {
-		cumCountX_1 += stats->counts[i];
-	}
-	cumCountX = cumCountX_1 + stats->counts[x];
+	stream_symbol_range(stats, x, &cumCountX_1, &cumCountX);
 
 	assert(cumCountX_1 < cumCountX);
     
@@ -49,64 +126,35 @@ void arithmetic_encoder_step(Arithmetic_code a, stream_stats_ptr_t stats, int32_
     
 	assert(a->l <= a->u);
     
-    // Check the rescaling conditions
-    msbL = a->l >> msb_shift;
-    msbU = a->u >> msb_shift;
-    E1_E2 = (msbL == msbU);
-	E3 = 0;
-    
-    if (!E1_E2) {
-		smsbL = a->l >> smsb_shift;
-		smsbU = a->u >> smsb_shift;
-		E3 = (smsbL == 0x01 && smsbU == 0x02);
-    }
-    
-	// While the bounds need rescaling
-    while (E1_E2 || E3) {
-        if (E1_E2) {
-			// We are in one half of the integer range so the next bit is fixed as the MSB
-			stream_write_bit(os, msbL);
-
-			// Clear the msb from both bounds and rescale them
-			a->l = (a->l & msb_clear_mask) << 1;
-			a->u = ((a->u & msb_clear_mask) << 1) + 1;
-            
-			// Write any extra bits based on the number of rescalings without an output before now
-            while (a->scale3 > 0) {
-				stream_write_bit(os, !msbL);
-                a->scale3 -= 1;
-            }
-        }
-		else { // E3 is true
-            a->scale3 += 1;
-			a->u = (((a->u << 1) & msb_clear_mask) | (1 << msb_shift)) + 1;
-			a->l = (a->l << 1) & msb_clear_mask;
-        }
-
-        msbL = a->l >> msb_shift;
-        msbU = a->u >> msb_shift;
-        E1_E2 = (msbL == msbU);
-		E3 = 0;
-
-        if (!E1_E2) {
-			smsbL = a->l >> smsb_shift;
-			smsbU = a->u >> smsb_shift;
-			E3 = (smsbL == 0x01 && smsbU == 0x02);
-        }
-    }
+	// E1/E2: the settled bits go out, the first followed by the bits owed to earlier E3 rescalings
+	settled = settled_bits(a);
+	if (settled) {
+		msbL = a->l >> msb_shift;
+		stream_write_bit(os, msbL);
+		write_pending_bits(os, !msbL, a->scale3);
+		a->scale3 = 0;
+		stream_write_bits(os, a->l >> (a->m - settled), settled - 1);
+
+		a->l = (a->l << settled) & mask;
+		a->u = ((a->u << settled) & mask) | ((1 << settled) - 1);
+	}
+
+	// E3: drop the second bit of both bounds until they no longer straddle the midpoint
+	straddling = straddling_bits(a);
+	if (straddling) {
+		a->scale3 += straddling;
+		a->l = (a->l << straddling) & msb_clear_mask;
+		a->u = ((a->u << straddling) & msb_clear_mask) | (1 << msb_shift) | ((1 << straddling) - 1);
+	}
 }
 
 int encoder_last_step(Arithmetic_code a, osStream os) {
     uint8_t msbL = a->l >> (a->m - 1);
 
-    // Write the msb of the tag (l)
+    // Write the msb of the tag (l), then as many !msbL as scale3 left
 	stream_write_bit(os, msbL);
-    
-    // write as many !msbL as scale3 left
-    while (a->scale3 > 0) {
-		stream_write_bit(os, !msbL);
-        a->scale3 -= 1;
-    }
+	write_pending_bits(os, !msbL, a->scale3);
+	a->scale3 = 0;
     
     // write the rest of the tag (l)
 	stream_write_bits(os, a->l, a->m - 1);
@@ -117,90 +165,122 @@ int encoder_last_step(Arithmetic_code a, osStream os) {
 
 uint32_t arithmetic_decoder_step(Arithmetic_code a, stream_stats_ptr_t stats, osStream is) {
     uint64_t range = 0, tagGap = 0;
-    int32_t k = 0, x = -1, i;
-    uint32_t subRange = 0, cumCountX = 0, cumCountX_1 = 0, cumCount = 0;
-    
-    uint8_t msbU = 0, msbL = 0, E1_E2 = 0, E3 = 0, smsbL = 0, smsbU = 0;
+    uint32_t x;
+    uint32_t subRange = 0, cumCountX = 0, cumCountX_1 = 0;
+	uint32_t settled, straddling;
     
 	// Again, these are actually constants
 	uint32_t msb_shift = a->m - 1;
-	uint32_t smsb_shift = a->m - 2;
 	uint32_t msb_clear_mask = (1 << msb_shift) - 1;
+	uint32_t mask = (1 << a->m) - 1;
 
     range = a->u - a->l + 1;
     tagGap = a->t - a->l + 1;
     
 	// @todo figure this out
     subRange = (uint32_t)((tagGap * stats->n - 1) / range);
-    while (subRange >= cumCount)
-        cumCount += stats->counts[k++];
-    x = --k;
-  
-	cumCountX_1 = 0;
-	for (i = 0; i < x; ++i) {
-		cumCountX_1 += stats->counts[i];
-	}
-	cumCountX = cumCountX_1 + stats->counts[x];
+	x = stats->cumCounts ? find_stream_symbol(stats, subRange) : scan_stream_symbol(stats, subRange);
+	stream_symbol_range(stats, x, &cumCountX_1, &cumCountX);
     
     a->u = a->l + (uint32_t)((range * cumCountX) / stats->n) - 1;
     a->l = a->l + (uint32_t)((range * cumCountX_1) / stats->n);
     
-    // Check the rescaling conditions.
-    msbL = a->l >> msb_shift;
-    msbU = a->u >> msb_shift;
-    
-    E1_E2 = (msbL == msbU);
-	E3 = 0;
-    
-    // If E1 or E2 doen't hold, check E3
-    if (!E1_E2) {
-		smsbL = a->l >> smsb_shift;
-		smsbU = a->u >> smsb_shift;
-		E3 = (smsbL == 0x01 && smsbU == 0x02);
-    }
-    
-    // While any of E conditions hold
-    while (E1_E2 || E3) {
-        if (E1_E2) {
-			a->l = (a->l & msb_clear_mask) << 1;
-			a->u = ((a->u & msb_clear_mask) << 1) + 1;
-			a->t = ((a->t & msb_clear_mask) << 1) + stream_read_bit(is);
-        }
-        else { // E3 is true
-			a->l = (a->l << 1) & msb_clear_mask;
-			a->u = (((a->u << 1) & msb_clear_mask) | (1 << msb_shift)) + 1;
-			a->t = (((a->t & msb_clear_mask) << 1) ^ (1 << msb_shift)) + stream_read_bit(is);
-        }
-        
-		msbL = a->l >> msb_shift;
-        msbU = a->u >> msb_shift;
-        E1_E2 = (msbL == msbU);
-		E3 = 0;
-            
-        if (!E1_E2) {
-			smsbL = a->l >> smsb_shift;
-			smsbU = a->u >> smsb_shift;
-			E3 = (smsbL == 0x01 && smsbU == 0x02);
-        }
-    }
+	// Same rescalings as the encoder, with the tag taking in one new bit for each
+	settled = settled_bits(a);
+	if (settled) {
+		a->l = (a->l << settled) & mask;
+		a->u = ((a->u << settled) & mask) | ((1 << settled) - 1);
+		a->t = ((a->t << settled) & mask) | stream_read_bits(is, settled);
+	}
+
+	// The tag lies between the bounds, so its second bit is the complement of its MSB and is dropped
+	straddling = straddling_bits(a);
+	if (straddling) {
+		a->l = (a->l << straddling) & msb_clear_mask;
+		a->u = ((a->u << straddling) & msb_clear_mask) | (1 << msb_shift) | ((1 << straddling) - 1);
+		a->t = (a->t & (1 << msb_shift)) | ((a->t << straddling) & msb_clear_mask) | stream_read_bits(is, straddling);
+	}
     
     return x;
 }
 
 uint32_t decoder_last_step(Arithmetic_code a, stream_stats_ptr_t stats) {
     uint64_t range, tagGap, subRange;
-    uint32_t k = 0, cumCount = 0, x;
     
     range = a->u - a->l + 1;
     tagGap = a->t - a->l + 1;
     
     subRange = (tagGap * stats->n -1) / range;
     
-    while (subRange >= cumCount)
-        cumCount += stats->counts[k++];
-    
-    x = --k;
-    
-    return x;
+	if (stats->cumCounts)
+		return find_stream_symbol(stats, (uint32_t) subRange);
+	return scan_stream_symbol(stats, (uint32_t) subRange);
+}
+
+
+Range_code initialize_range_coder() {
+	Range_code rc = (Range_code) calloc(1, sizeof(struct range_coder_t));
+
+	rc->low = 0;
+	rc->range = ~0ULL;
+	return rc;
 }
 
+/**
+ * Narrows the range to symbol x. The total count is at most the stats' rescaling
+ * condition, far below RANGE_BOTTOM, so range / n keeps plenty of precision
+ */
+void range_encoder_step(Range_code rc, stream_stats_ptr_t stats, uint32_t x, osStream os) {
+	uint32_t cumCountX, cumCountX_1;
+
+	assert(x < stats->alphabetCard);
+
+	stream_symbol_range(stats, x, &cumCountX_1, &cumCountX);
+	rc->range /= stats->n;
+	rc->low += cumCountX_1 * rc->range;
+	rc->range *= cumCountX - cumCountX_1;
+	range_encoder_normalize(rc, os);
+}
+
+/**
+ * Writes all of low, which is enough for the decoder to find the last symbol
+ */
+int range_encoder_last_step(Range_code rc, osStream os) {
+	uint32_t i;
+
+	for (i = 0; i < 8; ++i) {
+		stream_write_byte(os, (uint8_t) (rc->low >> 56));
+		rc->low <<= 8;
+	}
+	stream_write_buffer(os);
+
+	return os->written;
+}
+
+void range_decoder_start(Range_code rc, osStream is) {
+	uint32_t i;
+
+	for (i = 0; i < 8; ++i) {
+		rc->code = (rc->code << 8) | stream_read_byte(is);
+	}
+}
+
+uint32_t range_decoder_step(Range_code rc, stream_stats_ptr_t stats, osStream is) {
+	uint32_t x, target;
+	uint32_t cumCountX, cumCountX_1;
+	uint64_t scaled;
+
+	rc->range /= stats->n;
+	scaled = (rc->code - rc->low) / rc->range;
+
+	// Only a damaged stream can point past the last symbol
+	target = (scaled < stats->n) ? (uint32_t) scaled : stats->n - 1;
+	x = stats->cumCounts ? find_stream_symbol(stats, target) : scan_stream_symbol(stats, target);
+
+	stream_symbol_range(stats, x, &cumCountX_1, &cumCountX);
+	rc->low += cumCountX_1 * rc->range;
+	rc->range *= cumCountX - cumCountX_1;
+	range_decoder_normalize(rc, is);
+
+	return x;
+}
@@ -0,0 +1,171 @@
+#include <assert.h>
+#include "qv_compressor.h"
+
+/**
+ * Builds the bins of a context, all equally likely, with the first symbol as its mode
+ */
+static struct binary_model_t *binary_build_model(stream_stats_ptr_t stats) {
+	uint32_t bits = 0, card = stats->alphabetCard, i;
+	struct binary_model_t *model;
+
+	while (card > 2 && (1U << bits) < card - 1)
+		bits += 1;
+
+	model = (struct binary_model_t *) malloc(sizeof(struct binary_model_t) + (1 << bits) * sizeof(struct binary_bin_t));
+	model->mode = 0;
+	model->treeBits = bits;
+	for (i = 0; i < (1U << bits); ++i) {
+		model->bins[i].prob = BINARY_PROB_ONE / 2;
+		model->bins[i].count = 0;
+	}
+
+	stats->binary = model;
+	return model;
+}
+
+/**
+ * Counts symbol x for the context's mode, which moves to x as soon as x has been seen
+ * more often. The counts are halved every BINARY_MODE_MAX or so symbols, so that the
+ * mode can follow changes
+ */
+static inline void binary_track_mode(stream_stats_ptr_t stats, struct binary_model_t *model, uint32_t x) {
+	uint32_t i, n = 0;
+
+	stats->counts[x] += 1;
+	stats->n += 1;
+	if (stats->counts[x] > stats->counts[model->mode])
+		model->mode = x;
+
+	if (stats->n > BINARY_MODE_MAX + stats->alphabetCard) {
+		for (i = 0; i < stats->alphabetCard; ++i) {
+			stats->counts[i] = (stats->counts[i] >> 1) + (stats->counts[i] != 0);
+			n += stats->counts[i];
+		}
+		stats->n = n;
+	}
+}
+
+/**
+ * Moves a bin's probability towards the bit just coded. The rate starts at 1/2 and slows
+ * down as 1/(count+2) rounded to a power of two, until it reaches 1/2^BINARY_ADAPT_SHIFT
+ */
+static inline void binary_adapt(struct binary_bin_t *bin, uint32_t bit) {
+	uint32_t shift = 31 - count_leading_zeros(bin->count + 2);
+
+	if (shift >= BINARY_ADAPT_SHIFT)
+		shift = BINARY_ADAPT_SHIFT;
+	else
+		bin->count += 1;
+
+	if (bit)
+		bin->prob -= bin->prob >> shift;
+	else
+		bin->prob += (BINARY_PROB_ONE - bin->prob) >> shift;
+}
+
+static inline void binary_encode_bit(Range_code rc, struct binary_bin_t *bin, uint32_t bit, osStream os) {
+	uint64_t bound = (rc->range >> BINARY_PROB_BITS) * bin->prob;
+
+	if (bit) {
+		rc->low += bound;
+		rc->range -= bound;
+	}
+	else {
+		rc->range = bound;
+	}
+	binary_adapt(bin, bit);
+	range_encoder_normalize(rc, os);
+}
+
+static inline uint32_t binary_decode_bit(Range_code rc, struct binary_bin_t *bin, osStream is) {
+	uint64_t bound = (rc->range >> BINARY_PROB_BITS) * bin->prob;
+	uint32_t bit = (rc->code - rc->low >= bound);
+
+	if (bit) {
+		rc->low += bound;
+		rc->range -= bound;
+	}
+	else {
+		rc->range = bound;
+	}
+	binary_adapt(bin, bit);
+	range_decoder_normalize(rc, is);
+	return bit;
+}
+
+/**
+ * Codes symbol x as its bins. Stats that are never updated (a step of 0) hold equally
+ * likely raw bits, which are coded directly without a probability
+ */
+void binary_encoder_step(Range_code rc, stream_stats_ptr_t stats, uint32_t x, osStream os) {
+	struct binary_model_t *model = stats->binary;
+	uint32_t node = 1, bit, e, i;
+
+	assert(x < stats->alphabetCard);
+
+	if (stats->step == 0) {
+		rc->range >>= 1;
+		if (x)
+			rc->low += rc->range;
+		range_encoder_normalize(rc, os);
+		return;
+	}
+
+	// A single symbol takes no bits at all
+	if (stats->alphabetCard == 1)
+		return;
+	if (!model)
+		model = binary_build_model(stats);
+
+	binary_encode_bit(rc, &model->bins[0], x != model->mode, os);
+	if (x != model->mode) {
+		e = x - (x > model->mode);
+		for (i = model->treeBits; i > 0; --i) {
+			bit = (e >> (i-1)) & 1;
+			binary_encode_bit(rc, &model->bins[node], bit, os);
+			node = 2*node + bit;
+		}
+	}
+
+	binary_track_mode(stats, model, x);
+}
+
+uint32_t binary_decoder_step(Range_code rc, stream_stats_ptr_t stats, osStream is) {
+	struct binary_model_t *model = stats->binary;
+	uint32_t node = 1, x, i;
+
+	if (stats->step == 0) {
+		rc->range >>= 1;
+		x = (rc->code - rc->low >= rc->range);
+		if (x)
+			rc->low += rc->range;
+		range_decoder_normalize(rc, is);
+		return x;
+	}
+
+	if (stats->alphabetCard == 1)
+		return 0;
+	if (!model)
+		model = binary_build_model(stats);
+
+	if (!binary_decode_bit(rc, &model->bins[0], is)) {
+		x = model->mode;
+	}
+	else if (model->treeBits == 0) {
+		x = 1 - model->mode;
+	}
+	else {
+		for (i = model->treeBits; i > 0; --i) {
+			node = 2*node + binary_decode_bit(rc, &model->bins[node], is);
+		}
+		x = node - (1 << model->treeBits);
+		x += (x >= model->mode);
+		if (x >= stats->alphabetCard) {
+			printf("Damaged binary coded symbol in coded block.\n");
+			exit(1);
+		}
+	}
+
+	binary_track_mode(stats, model, x);
+	return x;
+}
@@ -34,9 +34,10 @@ struct cluster_list_t *alloc_cluster_list(struct quality_file_t *info) {
 	for (j = 0; j < info->cluster_count; ++j) {
 		rtn->clusters[j].id = j;
 		rtn->clusters[j].count = 0;
-		rtn->clusters[j].mean = (symbol_t *) calloc(info->columns, sizeof(symbol_t));
-		rtn->clusters[j].accumulator = (uint64_t *) calloc(info->columns, sizeof(uint64_t));
-		rtn->clusters[j].training_stats = alloc_conditional_pmf_list(info->alphabet, info->columns);
+		rtn->clusters[j].mean = (symbol_t *) calloc(MODEL_COLUMNS(info), sizeof(symbol_t));
+		rtn->clusters[j].accumulator = (uint64_t *) calloc(MODEL_COLUMNS(info), sizeof(uint64_t));
+		rtn->clusters[j].coverage = (uint64_t *) calloc(MODEL_COLUMNS(info), sizeof(uint64_t));
+		rtn->clusters[j].training_stats = alloc_conditional_pmf_list(info->alphabet, MODEL_COLUMNS(info));
 	}
 
 	return rtn;
@@ -51,6 +52,7 @@ void free_cluster_list(struct cluster_list_t *clusters) {
 	for (j = 0; j < clusters->count; ++j) {
 		free(clusters->clusters[j].mean);
 		free(clusters->clusters[j].accumulator);
+		free(clusters->clusters[j].coverage);
 		free_conditional_pmf_list(clusters->clusters[j].training_stats);
 	}
 	free(clusters->distances);
@@ -75,7 +77,7 @@ uint8_t cluster_lines(struct line_block_t *block, struct quality_file_t *info) {
 
 /**
  * Updates the cluster means based on their assigned lines. Also clears the line count for
- * the next iteration.
+ * the next iteration. Each column's mean only counts the lines long enough to reach it
  */
 double recalculate_means(struct quality_file_t *info) {
 	uint32_t block, line_idx;
@@ -88,7 +90,8 @@ double recalculate_means(struct quality_file_t *info) {
 
 	// Reset cluster accumulators for new center calculation
 	for (i = 0; i < info->cluster_count; ++i) {
-		memset(info->clusters->clusters[i].accumulator, 0, info->columns*sizeof(uint64_t));
+		memset(info->clusters->clusters[i].accumulator, 0, MODEL_COLUMNS(info)*sizeof(uint64_t));
+		memset(info->clusters->clusters[i].coverage, 0, MODEL_COLUMNS(info)*sizeof(uint64_t));
 	}
 
 	// Iterate linewise to accumulate into cluster centers
@@ -96,8 +99,9 @@ double recalculate_means(struct quality_file_t *info) {
 		for (line_idx = 0; line_idx < info->blocks[block].count; ++line_idx) {
 			line = &info->blocks[block].lines[line_idx];
 			cluster = &info->clusters->clusters[line->cluster];
-			for (i = 0; i < info->columns; ++i) {
-				cluster->accumulator[i] += line->m_data[i];
+			for (i = 0; i < line->length; ++i) {
+				cluster->accumulator[MODEL_COLUMN(i)] += line->m_data[i];
+				cluster->coverage[MODEL_COLUMN(i)] += 1;
 			}
 		}
 	}
@@ -108,9 +112,13 @@ double recalculate_means(struct quality_file_t *info) {
 		dist = 0.0;
 		moved = 0.0;
 
-		for (j = 0; j < info->columns; ++j) {
+		for (j = 0; j < MODEL_COLUMNS(info); ++j) {
+			// Columns that none of the lines reach keep their mean
+			if (cluster->coverage[j] == 0)
+				continue;
+
 			// Integer division to find the mean, guaranteed to be less than the alphabet size
-			new_mean = (uint8_t) (cluster->accumulator[j] / cluster->count);
+			new_mean = (uint8_t) (cluster->accumulator[j] / cluster->coverage[j]);
 
 			// Also figure out how far we've moved
 			dist = new_mean - cluster->mean[j];
@@ -171,16 +179,17 @@ uint8_t assign_cluster(struct line_t *line, struct quality_file_t *info) {
 }
 
 /**
- * Take a line and cluster information and calculates the distance, storing it in the line information vector
+ * Take a line and cluster information and calculates the distance, storing it in the line information vector.
+ * Only the columns the line reaches are compared
  */
 void find_distance(struct line_t *line, struct cluster_t *cluster, struct quality_file_t *info) {
 	double d = 0.0;
 	uint32_t i;
 	uint32_t data, mean;
 
-	for (i = 0; i < info->columns; ++i) {
+	for (i = 0; i < line->length; ++i) {
 		data = line->m_data[i];
-		mean = cluster->mean[i];
+		mean = cluster->mean[MODEL_COLUMN(i)];
 		d += (data - mean) * (data - mean);
 	}
 	info->clusters->distances[cluster->id] = d;
@@ -193,12 +202,16 @@ void initialize_kmeans_clustering(struct quality_file_t *info) {
 	uint8_t j;
 	uint32_t block_id;
 	uint32_t line_id;
+	uint32_t length;
 	struct cluster_list_t *clusters = info->clusters;
 
 	for (j = 0; j < info->cluster_count; ++j) {
 		block_id = rand() % info->block_count;
 		line_id = rand() % info->blocks[block_id].count;
-		memcpy(clusters->clusters[j].mean, info->blocks[block_id].lines[line_id].m_data, info->columns*sizeof(uint8_t));
+		length = info->blocks[block_id].lines[line_id].length;
+		if (length > MODEL_COLUMNS(info))
+			length = MODEL_COLUMNS(info);
+		memcpy(clusters->clusters[j].mean, info->blocks[block_id].lines[line_id].m_data, length*sizeof(uint8_t));
 		if (info->opts->verbose) {
 			printf("Chose block %d, line %d.\n", block_id, line_id);
 		}
@@ -157,10 +157,22 @@ void store_cond_quantizers_indexed(struct quantizer_t *restrict lo, struct quant
 }
 
 /**
- * Selects a quantizer for the given column from the quantizer list with the appropriate ratio
+ * Selects a quantizer for the given column from the quantizer list with the appropriate ratio.
+ * The column is a model column (see MODEL_COLUMN). The last model column is reused for the
+ * rest of a long read, where the left context comes from its own outputs and may not be in
+ * its input alphabet, so the nearest symbol that is stands in for it
  */
 struct quantizer_t *choose_quantizer(struct cond_quantizer_list_t *list, struct well_state_t *well, uint32_t column, symbol_t prev, uint32_t *q_idx) {
-	uint32_t idx = get_symbol_index(list->input_alphabets[column], prev);
+	const struct alphabet_t *A = list->input_alphabets[column];
+	uint32_t idx = get_symbol_index(A, prev);
+	uint32_t d;
+
+	for (d = 1; idx == ALPHABET_SYMBOL_NOT_FOUND && column == list->columns - 1; ++d) {
+		if (prev >= d)
+			idx = get_symbol_index(A, prev - d);
+		if (idx == ALPHABET_SYMBOL_NOT_FOUND && prev + d < ALPHABET_INDEX_SIZE_HINT)
+			idx = get_symbol_index(A, prev + d);
+	}
 	assert(idx != ALPHABET_SYMBOL_NOT_FOUND);
 	if (well_1024a_bits(well, 7) >= list->qratio[column][idx]) {
         *q_idx = 2*idx+1;
@@ -196,10 +208,12 @@ void calculate_statistics(struct quality_file_t *info) {
 			cluster = &info->clusters->clusters[line->cluster];
 			pmf_list = cluster->training_stats;
 
-			// First, find conditional PMFs
+			// First, find conditional PMFs, over the columns this line reaches
+			if (line->length == 0)
+				continue;
 			pmf_increment(get_cond_pmf(pmf_list, 0, 0), line->m_data[0] - 33);
-			for (column = 1; column < info->columns; ++column) {
-				pmf_increment(get_cond_pmf(pmf_list, column, line->m_data[column-1] - 33), line->m_data[column] - 33);
+			for (column = 1; column < line->length; ++column) {
+				pmf_increment(get_cond_pmf(pmf_list, MODEL_COLUMN(column), line->m_data[column-1] - 33), line->m_data[column] - 33);
 			}
 		}
 	}
@@ -209,9 +223,9 @@ void calculate_statistics(struct quality_file_t *info) {
 		cluster = &info->clusters->clusters[c];
 		pmf_list = cluster->training_stats;
 
-		pmf_list->marginal_pmfs = alloc_pmf_list(info->columns, pmf_list->alphabet);
+		pmf_list->marginal_pmfs = alloc_pmf_list(MODEL_COLUMNS(info), pmf_list->alphabet);
 		combine_pmfs(get_cond_pmf(pmf_list, 0, 0), pmf_list->marginal_pmfs->pmfs[0], 1.0, 0.0, pmf_list->marginal_pmfs->pmfs[0]);
-		for (column = 1; column < info->columns; ++column) {
+		for (column = 1; column < MODEL_COLUMNS(info); ++column) {
 			for (j = 0; j < pmf_list->alphabet->size; ++j) {
 				combine_pmfs(pmf_list->marginal_pmfs->pmfs[column], get_cond_pmf(pmf_list, column, j), 1.0, get_probability(pmf_list->marginal_pmfs->pmfs[column-1], j), pmf_list->marginal_pmfs->pmfs[column]);
 			}
@@ -387,7 +401,7 @@ void generate_codebooks(struct quality_file_t *info) {
 	struct distortion_t *dist = info->dist;
 
 	for (cluster_id = 0; cluster_id < info->cluster_count; ++cluster_id) {
-		q_list = alloc_conditional_quantizer_list(info->columns);
+		q_list = alloc_conditional_quantizer_list(MODEL_COLUMNS(info));
 		info->clusters->clusters[cluster_id].qlist = q_list;
 		in_pmfs = info->clusters->clusters[cluster_id].training_stats;
     
@@ -416,7 +430,7 @@ void generate_codebooks(struct quality_file_t *info) {
     	prev_qpmf_list = qpmf_list;
     
     	// Start computing the quantizers of the rest of the columns
-    	for (column = 1; column < info->columns; column++) {
+    	for (column = 1; column < MODEL_COLUMNS(info); column++) {
         	// Compute the next output alphabet union over all quantizers for this column
 			q_output_union = duplicate_alphabet(get_cond_quantizer_indexed(q_list, column-1, 0)->output_alphabet);
 			for (j = 1; j < 2*q_prev_output_union->size; ++j) {
@@ -472,18 +486,26 @@ void generate_codebooks(struct quality_file_t *info) {
  * metadata (columns, lines, cluster counts) first
  */
 void write_codebooks(FILE *fp, struct quality_file_t *info) {
-	uint32_t columns, lines;
+	uint32_t columns, lines[2];
 	uint32_t j;
 	char linebuf[1];
 
+	// File starts with the magic tag (3 bytes), format version (1 byte) and coder with its estimator and lanes (1 byte)
+	fwrite(QVZ_MAGIC, sizeof(char), 3, fp);
+	linebuf[0] = QVZ_FORMAT_VERSION;
+	fwrite(linebuf, sizeof(char), 1, fp);
+	linebuf[0] = info->coder | (info->estimator << QV_ESTIMATOR_SHIFT) | ((info->lanes - 1) << QV_LANES_SHIFT);
+	fwrite(linebuf, sizeof(char), 1, fp);
+
 	// Header line is number of clusters (1 byte)
-	// number of columns (4), total number of lines (4), then a newline
+	// number of columns (4), then total number of lines (8, high word first)
 	columns = htonl(info->columns);
-	lines = htonl((uint32_t)info->lines);
+	lines[0] = htonl((uint32_t) (info->lines >> 32));
+	lines[1] = htonl((uint32_t) info->lines);
 	linebuf[0] = info->cluster_count;
 	fwrite(linebuf, sizeof(char), 1, fp);
 	fwrite(&columns, sizeof(uint32_t), 1, fp);
-	fwrite(&lines, sizeof(uint32_t), 1, fp);
+	fwrite(lines, sizeof(uint32_t), 2, fp);
 
 	// Now, write each cluster's codebook in order
 	for (j = 0; j < info->cluster_count; ++j) {
@@ -559,17 +581,44 @@ void write_codebook(FILE *fp, struct cond_quantizer_list_t *quantizers) {
  */
 void read_codebooks(FILE *fp, struct quality_file_t *info) {
 	uint8_t j;
-	char line[9];
+	uint32_t lines[2];
+	char line[5];
+
+	// Check that this is a file we know how to read
+	if (fread(line, sizeof(char), 4, fp) != 4 || memcmp(line, QVZ_MAGIC, 3) != 0) {
+		printf("Input is not a qvz file.\n");
+		exit(1);
+	}
+	if (line[3] != QVZ_FORMAT_VERSION) {
+		printf("Unsupported qvz format version %d (expected %d).\n", line[3], QVZ_FORMAT_VERSION);
+		exit(1);
+	}
+
+	if (fread(line, sizeof(char), 1, fp) != 1 || (line[0] & QV_CODER_MASK) > QV_CODER_BINARY) {
+		printf("Unsupported entropy coder %d.\n", line[0] & QV_CODER_MASK);
+		exit(1);
+	}
+	info->coder = line[0] & QV_CODER_MASK;
+	info->estimator = (line[0] >> QV_ESTIMATOR_SHIFT) & QV_ESTIMATOR_MASK;
+	if (info->estimator > QV_ESTIMATOR_STATE) {
+		printf("Unsupported probability estimator %d.\n", info->estimator);
+		exit(1);
+	}
+	info->lanes = 1 + ((uint8_t) line[0] >> QV_LANES_SHIFT);
+	if (info->lanes > QV_MAX_LANES || (info->lanes > 1 && info->coder != QV_CODER_RANS && info->coder != QV_CODER_TANS)) {
+		printf("Unsupported number of coder lanes %d.\n", info->lanes);
+		exit(1);
+	}
 
 	// Figure out how many clusters we have to set up cluster sizes
-	fread(line, sizeof(char), 9, fp);
+	fread(line, sizeof(char), 5, fp);
 	info->cluster_count = line[0];
 
-	// Recover columns and lines as 32 bit integers
+	// Recover columns as a 32 bit integer and lines as a 64 bit integer
 	info->columns = (line[1] & 0xff) | ((line[2] << 8) & 0xff00) | ((line[3] << 16) & 0xff0000) | ((line[4] << 24) & 0xff000000);
 	info->columns = ntohl(info->columns);
-	info->lines = (line[5] & 0xff) | ((line[6] << 8) & 0xff00) | ((line[7] << 16) & 0xff0000) | ((line[8] << 24) & 0xff000000);
-	info->lines = ntohl(info->lines);
+	fread(lines, sizeof(uint32_t), 2, fp);
+	info->lines = (((uint64_t) ntohl(lines[0])) << 32) | ntohl(lines[1]);
 	
 	// Can't allocate clusters until we know how many columns there are
 	info->clusters = alloc_cluster_list(info);
@@ -592,10 +641,10 @@ struct cond_quantizer_list_t *read_codebook(FILE *fp, struct quality_file_t *inf
 	char line[MAX_CODEBOOK_LINE_LENGTH];
 	uint8_t qratio;
 	struct alphabet_t *A = info->alphabet;
-	uint32_t columns = info->columns;
+	uint32_t columns = MODEL_COLUMNS(info);
 
 	uniques = alloc_alphabet(1);
-	qlist = alloc_conditional_quantizer_list(info->columns);
+	qlist = alloc_conditional_quantizer_list(columns);
 	cond_quantizer_init_column(qlist, 0, uniques);
 	free_alphabet(uniques);
 
@@ -0,0 +1,430 @@
+/**
+ * Background gzip decompression for loading compressed input without inflating it
+ * to disk first
+ */
+
+#include "gz_reader.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lines.h"
+
+#if defined(HAVE_ZLIB) && (defined(LINUX) || defined(__APPLE__))
+	#include <unistd.h>
+	#include <zlib.h>
+	#define GZ_READER_AVAILABLE
+#endif
+
+// Returned for gzip members that can't be located without inflating them
+#define GZ_MEMBER_INVALID			UINT32_MAX
+
+/**
+ * Checks for the gzip magic number at the start of the file
+ */
+uint32_t is_gzip_file(const char *path) {
+	unsigned char magic[2];
+	FILE *fp = fopen(path, "rb");
+	uint32_t rtn = 0;
+
+	if (!fp)
+		return 0;
+	if (fread(magic, sizeof(unsigned char), 2, fp) == 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		rtn = 1;
+	fclose(fp);
+
+	return rtn;
+}
+
+#ifdef GZ_READER_AVAILABLE
+
+/**
+ * A single BGZF member read from the file, and where its output goes
+ */
+struct gz_member_t {
+	uint8_t *data;
+	uint32_t len;
+	uint32_t hdr_len;
+	uint32_t isize;
+	uint64_t out_offset;
+};
+
+/**
+ * A group of members that are inflated together, GZ_MEMBERS_PER_JOB per thread
+ */
+struct gz_batch_t {
+	struct gz_member_t *members;
+	uint32_t count;
+	char *out;
+	uint32_t failed;
+};
+
+/**
+ * Reads the header of the next gzip member and finds its total length from the BC
+ * extra subfield that BGZF stores
+ * @param hdr Receives the first 12 + XLEN bytes of the member, must have room for 65547
+ * @return Total length of the member in bytes, 0 at the end of the file, or
+ * GZ_MEMBER_INVALID if the member is damaged or has no BC subfield
+ */
+static uint32_t gz_read_member_header(FILE *fp, uint8_t *hdr, uint32_t *hdr_len) {
+	uint32_t xlen, pos, slen;
+	size_t n;
+
+	n = fread(hdr, sizeof(uint8_t), 12, fp);
+	if (n == 0)
+		return 0;
+	if (n != 12 || hdr[0] != 0x1f || hdr[1] != 0x8b || hdr[2] != 8 || hdr[3] != 4)
+		return GZ_MEMBER_INVALID;
+
+	xlen = hdr[10] | (hdr[11] << 8);
+	if (fread(hdr + 12, sizeof(uint8_t), xlen, fp) != xlen)
+		return GZ_MEMBER_INVALID;
+	*hdr_len = 12 + xlen;
+
+	// Walk the extra subfields looking for BC
+	pos = 12;
+	while (pos + 4 <= 12 + xlen) {
+		slen = hdr[pos+2] | (hdr[pos+3] << 8);
+		if (hdr[pos] == 'B' && hdr[pos+1] == 'C' && slen == 2)
+			return (hdr[pos+4] | (hdr[pos+5] << 8)) + 1;
+		pos += 4 + slen;
+	}
+
+	return GZ_MEMBER_INVALID;
+}
+
+/**
+ * Inflates every member assigned to one job directly into its place in the output
+ */
+static void gz_inflate_job(void *ctx, uint32_t job) {
+	struct gz_batch_t *batch = (struct gz_batch_t *) ctx;
+	struct gz_member_t *m;
+	z_stream zs;
+	uint32_t i, end, crc;
+	int ret;
+
+	end = (job+1) * GZ_MEMBERS_PER_JOB;
+	if (end > batch->count)
+		end = batch->count;
+
+	for (i = job * GZ_MEMBERS_PER_JOB; i < end; ++i) {
+		m = &batch->members[i];
+
+		memset(&zs, 0, sizeof(z_stream));
+		inflateInit2(&zs, -15);
+		zs.next_in = m->data + m->hdr_len;
+		zs.avail_in = m->len - m->hdr_len - 8;
+		zs.next_out = (Bytef *) (batch->out + m->out_offset);
+		zs.avail_out = m->isize;
+		ret = inflate(&zs, Z_FINISH);
+		inflateEnd(&zs);
+
+		crc = m->data[m->len-8] | (m->data[m->len-7] << 8) | (m->data[m->len-6] << 16) | ((uint32_t) m->data[m->len-5] << 24);
+		if (ret != Z_STREAM_END || zs.total_out != m->isize || crc32(0, (Bytef *) (batch->out + m->out_offset), m->isize) != crc)
+			batch->failed = 1;
+	}
+}
+
+/**
+ * Hands a finished chunk to the consumer, waiting for a free slot in the ring
+ */
+static void gz_push(struct gz_reader_t *r, char *data, uint64_t len) {
+	pthread_mutex_lock(&r->lock);
+	while (r->count == r->slots && !r->done)
+		pthread_cond_wait(&r->space, &r->lock);
+
+	// The consumer gave up early
+	if (r->done) {
+		pthread_mutex_unlock(&r->lock);
+		free(data);
+		return;
+	}
+
+	r->ring[(r->head + r->count) % r->slots].data = data;
+	r->ring[(r->head + r->count) % r->slots].len = len;
+	r->count += 1;
+	pthread_cond_signal(&r->ready);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/**
+ * Checks whether the consumer has closed the reader, after which inflating any
+ * further is wasted work
+ */
+static uint32_t gz_closed(struct gz_reader_t *r) {
+	uint32_t done;
+
+	pthread_mutex_lock(&r->lock);
+	done = r->done;
+	pthread_mutex_unlock(&r->lock);
+	return done;
+}
+
+/**
+ * Emits the complete lines in buf[0..len) as a chunk and moves the trailing partial
+ * line into a fresh buffer, which is returned for the next chunk
+ * @param len Receives the length of the partial line at the start of the new buffer
+ */
+static char *gz_split_chunk(struct gz_reader_t *r, char *buf, uint64_t *len, uint64_t *cap) {
+	char *next;
+	uint64_t end = *len;
+
+	while (end > 0 && buf[end-1] != '\n')
+		end -= 1;
+
+	// A line longer than the whole chunk, keep growing the buffer instead
+	if (end == 0) {
+		*cap *= 2;
+		return (char *) realloc(buf, *cap);
+	}
+
+	*cap = r->chunk_len;
+	if (*len - end > *cap / 2)
+		*cap = 2 * (*len - end);
+	next = (char *) malloc(*cap);
+	memcpy(next, buf + end, *len - end);
+	*len -= end;
+
+	gz_push(r, buf, end);
+	return next;
+}
+
+/**
+ * Inflates a BGZF file a batch of members at a time, with the members of a batch
+ * spread over the worker threads
+ */
+static void gz_inflate_bgzf(struct gz_reader_t *r, char **buf, uint64_t *len, uint64_t *cap) {
+	struct gz_batch_t batch;
+	struct gz_member_t *m;
+	uint8_t *hdr = (uint8_t *) malloc(65547);
+	uint32_t max_members = r->threads * GZ_MEMBERS_PER_JOB;
+	uint32_t hdr_len, member_len, i;
+	uint64_t total;
+
+	// A batch inflates into the chunk being built, so it is kept to about a chunk
+	if (max_members > r->chunk_len / BGZF_MAX_MEMBER)
+		max_members = (uint32_t) (r->chunk_len / BGZF_MAX_MEMBER);
+	if (max_members < GZ_MEMBERS_PER_JOB)
+		max_members = GZ_MEMBERS_PER_JOB;
+
+	batch.members = (struct gz_member_t *) calloc(max_members, sizeof(struct gz_member_t));
+
+	do {
+		if (gz_closed(r))
+			break;
+
+		// Read in the next batch of members
+		batch.count = 0;
+		batch.failed = 0;
+		total = 0;
+		while (batch.count < max_members && (member_len = gz_read_member_header(r->fp, hdr, &hdr_len)) > 0) {
+			m = &batch.members[batch.count];
+			if (member_len == GZ_MEMBER_INVALID || member_len < hdr_len + 8) {
+				r->status = LF_ERROR_BAD_FORMAT;
+				break;
+			}
+			m->data = (uint8_t *) malloc(member_len);
+			m->len = member_len;
+			m->hdr_len = hdr_len;
+			memcpy(m->data, hdr, hdr_len);
+			if (fread(m->data + hdr_len, sizeof(uint8_t), member_len - hdr_len, r->fp) != member_len - hdr_len) {
+				free(m->data);
+				r->status = LF_ERROR_BAD_FORMAT;
+				break;
+			}
+			m->isize = m->data[member_len-4] | (m->data[member_len-3] << 8) | (m->data[member_len-2] << 16) | ((uint32_t) m->data[member_len-1] << 24);
+			m->out_offset = total;
+			total += m->isize;
+			batch.count += 1;
+		}
+
+		// Inflate them straight into the chunk being built
+		if (*len + total > *cap) {
+			*cap = *len + total;
+			*buf = (char *) realloc(*buf, *cap);
+		}
+		batch.out = *buf + *len;
+		run_parallel(gz_inflate_job, &batch, (batch.count + GZ_MEMBERS_PER_JOB - 1) / GZ_MEMBERS_PER_JOB, r->threads);
+		*len += total;
+
+		for (i = 0; i < batch.count; ++i) {
+			free(batch.members[i].data);
+		}
+		if (batch.failed)
+			r->status = LF_ERROR_BAD_FORMAT;
+
+		if (*len >= r->chunk_len)
+			*buf = gz_split_chunk(r, *buf, len, cap);
+	} while (batch.count == max_members && r->status == LF_ERROR_NONE);
+
+	free(batch.members);
+	free(hdr);
+}
+
+/**
+ * Inflates a plain (possibly multi-member) gzip file on the reader thread. A plain
+ * member's end can only be found by inflating it, so its members are not split up
+ * over threads the way BGZF members are
+ */
+static void gz_inflate_stream(struct gz_reader_t *r, char **buf, uint64_t *len, uint64_t *cap) {
+	gzFile gz;
+	int fd, n;
+
+	// zlib reads through its own descriptor, from the start of the file
+	fd = dup(fileno(r->fp));
+	lseek(fd, 0, SEEK_SET);
+	gz = gzdopen(fd, "rb");
+	if (!gz) {
+		r->status = LF_ERROR_NO_MEMORY;
+		return;
+	}
+	gzbuffer(gz, 1 << 20);
+
+	while ((n = gzread(gz, *buf + *len, (unsigned) (*cap - *len))) > 0) {
+		*len += n;
+		if (gz_closed(r))
+			break;
+		if (*len == *cap)
+			*buf = gz_split_chunk(r, *buf, len, cap);
+	}
+	if (n < 0)
+		r->status = LF_ERROR_BAD_FORMAT;
+
+	gzclose(gz);
+}
+
+/**
+ * Reader thread body, inflates the whole file into chunks
+ */
+static void *gz_reader_thread(void *arg) {
+	struct gz_reader_t *r = (struct gz_reader_t *) arg;
+	uint64_t cap = r->chunk_len;
+	uint64_t len = 0;
+	char *buf = (char *) malloc(cap);
+
+	if (r->bgzf && r->threads > 1)
+		gz_inflate_bgzf(r, &buf, &len, &cap);
+	else
+		gz_inflate_stream(r, &buf, &len, &cap);
+
+	// Whatever is left is the last chunk, which may not end with a newline
+	if (len > 0)
+		gz_push(r, buf, len);
+	else
+		free(buf);
+
+	pthread_mutex_lock(&r->lock);
+	r->done = 1;
+	pthread_cond_broadcast(&r->ready);
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+/**
+ * Opens a gzip file and starts inflating it on a background thread
+ * @param threads Number of threads used to inflate BGZF members in parallel
+ * @param chunk_len Chunk length to aim for, up to GZ_CHUNK_LEN (0 for GZ_CHUNK_LEN)
+ * @param slots Finished chunks that may wait to be taken, up to GZ_RING_SLOTS (0 for GZ_RING_SLOTS)
+ * @return Reader handle, or NULL if the file can't be opened
+ */
+struct gz_reader_t *gz_reader_open(const char *path, uint32_t threads, uint64_t chunk_len, uint32_t slots) {
+	struct gz_reader_t *r = (struct gz_reader_t *) calloc(1, sizeof(struct gz_reader_t));
+	uint8_t *hdr;
+	uint32_t hdr_len, member_len;
+
+	r->fp = fopen(path, "rb");
+	if (!r->fp) {
+		free(r);
+		return NULL;
+	}
+	r->threads = (threads < 1) ? 1 : threads;
+	r->status = LF_ERROR_NONE;
+	r->chunk_len = (chunk_len == 0 || chunk_len > GZ_CHUNK_LEN) ? GZ_CHUNK_LEN : chunk_len;
+	r->slots = (slots == 0 || slots > GZ_RING_SLOTS) ? GZ_RING_SLOTS : slots;
+
+	// Check whether the first member says where it ends
+	hdr = (uint8_t *) malloc(65547);
+	member_len = gz_read_member_header(r->fp, hdr, &hdr_len);
+	r->bgzf = (member_len > 0 && member_len != GZ_MEMBER_INVALID);
+	free(hdr);
+	rewind(r->fp);
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->ready, NULL);
+	pthread_cond_init(&r->space, NULL);
+	pthread_create(&r->thread, NULL, gz_reader_thread, r);
+
+	return r;
+}
+
+/**
+ * Takes the next chunk from the ring, waiting for the reader thread if necessary
+ * @return 1 if a chunk was returned, 0 at the end of the file
+ */
+uint32_t gz_reader_next(struct gz_reader_t *r, struct gz_chunk_t *chunk) {
+	pthread_mutex_lock(&r->lock);
+	while (r->count == 0 && !r->done)
+		pthread_cond_wait(&r->ready, &r->lock);
+
+	if (r->count == 0) {
+		pthread_mutex_unlock(&r->lock);
+		return 0;
+	}
+
+	*chunk = r->ring[r->head];
+	r->head = (r->head + 1) % r->slots;
+	r->count -= 1;
+	pthread_cond_signal(&r->space);
+	pthread_mutex_unlock(&r->lock);
+
+	return 1;
+}
+
+/**
+ * Stops the reader thread, discarding anything not yet consumed
+ * @return LF_ERROR_NONE, or the error that stopped decompression
+ */
+uint32_t gz_reader_close(struct gz_reader_t *r) {
+	uint32_t status;
+
+	pthread_mutex_lock(&r->lock);
+	r->done = 1;
+	pthread_cond_broadcast(&r->space);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+
+	while (r->count > 0) {
+		free(r->ring[r->head].data);
+		r->head = (r->head + 1) % r->slots;
+		r->count -= 1;
+	}
+
+	pthread_cond_destroy(&r->space);
+	pthread_cond_destroy(&r->ready);
+	pthread_mutex_destroy(&r->lock);
+	fclose(r->fp);
+
+	status = r->status;
+	free(r);
+	return status;
+}
+
+#else
+
+/**
+ * Without zlib (or threads) gzip input is not supported
+ */
+struct gz_reader_t *gz_reader_open(const char *path, uint32_t threads, uint64_t chunk_len, uint32_t slots) {
+	return NULL;
+}
+
+uint32_t gz_reader_next(struct gz_reader_t *r, struct gz_chunk_t *chunk) {
+	return 0;
+}
+
+uint32_t gz_reader_close(struct gz_reader_t *r) {
+	return LF_ERROR_NOT_SUPPORTED;
+}
+
+#endif
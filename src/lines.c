@@ -8,76 +8,528 @@
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
 
 #include "lines.h"
+#include "codebook.h"
+#include "gz_reader.h"
+
+static uint32_t load_gzip(const char *path, struct quality_file_t *info, uint64_t max_lines, uint8_t fastq);
+static uint32_t load_mapped(const char *path, struct quality_file_t *info, uint64_t max_lines, uint8_t fastq);
 
 /**
- * This reads data from the given file pointer into memory, breaking it into segments
- * of the given number of lines, to ease memory management issues at the cost of some
- * overhead. This assumes that the file consists entirely of quality scores with no
- * other lines in between
+ * Loads a file consisting entirely of quality scores, one read per line, indexing its
+ * lines in place (see map_input). Lines may have different lengths and may end in \n
+ * or \r\n. Gzip compressed files are inflated into memory instead
  * @param path Path of the file to read
  * @param info Information structure to store in, this must be a valid pointer already
  * @param max_lines Maximum number of lines to read, will override the actual number in the file if >0
- * @todo @xxx This assumes we have only newlines in the file despite some vague attempts to handle \r\n as well
- * @todo @xxx It WILL break the mapping if given a file with \r characters
  * @todo Implement windows analog to mmap to provide the same facility
  */
 uint32_t load_file(const char *path, struct quality_file_t *info, uint64_t max_lines) {
-	uint32_t status, block_idx, line_idx;
-	char line[READ_LINEBUF_LENGTH];
-	FILE *fp;
+	// Load metadata into the info structure
+	info->path = strdup(path);
+	info->buffers = NULL;
+	info->buffer_count = 0;
+	info->map = NULL;
+	info->map_size = 0;
+	info->error_line = 0;
+
+	// Compressed input has to be inflated into memory rather than mapped
+	if (is_gzip_file(path))
+		return load_gzip(path, info, max_lines, 0);
+
+	return load_mapped(path, info, max_lines, 0);
+}
+
+/**
+ * Touches one byte in every page of a slice of the mapping, so that its page faults
+ * are taken here rather than by the indexer. Run as a parallel job over the slices
+ */
+static void warm_pages(void *ctx, uint32_t job) {
+	struct page_warmer_t *w = (struct page_warmer_t *) ctx;
+	const volatile char *p = w->data + ((uint64_t) job) * w->slice;
+	const volatile char *end = p + w->slice;
+	char sink = 0;
+
+	if (end > w->data + w->size)
+		end = w->data + w->size;
+	for (; p < end; p += w->page) {
+		sink ^= *p;
+	}
+	w->sink[job] = sink;
+}
+
+/**
+ * Maps a whole file read-only for indexing in place. The kernel is told that the file
+ * will be read sequentially and soon, and that it may back it with huge pages where the
+ * filesystem allows. With more than one thread the pages are also faulted in ahead of
+ * the indexer by helper threads, each taking a slice of the file. The mapping is kept
+ * in info until free_blocks
+ */
+static uint32_t map_input(const char *path, struct quality_file_t *info) {
 	int fd;
 	struct _stat finfo;
-	void *file_mmap;
+	void *data;
+	struct page_warmer_t warmer;
+	uint32_t threads = (info->opts) ? info->opts->threads : 1;
+	uint32_t jobs;
 
-	// Load metadata into the info structure
-	info->path = strdup(path);
-	fp = fopen(path, "rt");
 	fd = open(path, O_RDONLY);
-	if (!fp || fd == -1) {
+	if (fd == -1) {
 		return LF_ERROR_NOT_FOUND;
 	}
+	fstat(fd, &finfo);
+	if (finfo.st_size == 0) {
+		close(fd);
+		return LF_ERROR_BAD_FORMAT;
+	}
+
+	data = mmap(NULL, finfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return LF_ERROR_NO_MEMORY;
+	}
+	info->map = data;
+	info->map_size = finfo.st_size;
+
+	// Access hints are only advice, so failures are ignored
+	madvise(data, finfo.st_size, MADV_SEQUENTIAL);
+	madvise(data, finfo.st_size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+	madvise(data, finfo.st_size, MADV_HUGEPAGE);
+#endif
+
+	if (threads > 1) {
+		warmer.data = (const char *) data;
+		warmer.size = finfo.st_size;
+		warmer.page = sysconf(_SC_PAGESIZE);
+		jobs = threads * PAGE_WARM_SLICES_PER_THREAD;
+		warmer.slice = (warmer.size + jobs - 1) / jobs;
+		warmer.slice = (warmer.slice + warmer.page - 1) / warmer.page * warmer.page;
+		jobs = (uint32_t) ((warmer.size + warmer.slice - 1) / warmer.slice);
+		warmer.sink = (char *) calloc(jobs, sizeof(char));
+		run_parallel(warm_pages, &warmer, jobs, threads);
+		free(warmer.sink);
+	}
+
+	return LF_ERROR_NONE;
+}
+
+/**
+ * Maps a file and indexes its lines in place, either as bare quality lines or FASTQ
+ */
+static uint32_t load_mapped(const char *path, struct quality_file_t *info, uint64_t max_lines, uint8_t fastq) {
+	struct line_indexer_t ix;
+	const char *data;
+	uint32_t status;
+
+	status = map_input(path, info);
+	if (status != LF_ERROR_NONE)
+		return status;
+	data = (const char *) info->map;
+
+	init_line_indexer(&ix, info, fastq, max_lines);
+	status = index_lines(&ix, data, data + info->map_size);
+	if (status == LF_ERROR_NONE && (max_lines == 0 || info->lines < max_lines))
+		status = finish_line_indexer(&ix);
+
+	return status;
+}
+
+/**
+ * Finds the end of the line starting at p
+ * @param len Receives the length of the line, without the line ending (\n or \r\n)
+ * @return Start of the next line, or end if this was the last one
+ */
+static const char *next_line(const char *p, const char *end, uint32_t *len) {
+	const char *nl = (const char *) memchr(p, '\n', end - p);
+
+	if (!nl)
+		nl = end;
+	*len = (uint32_t) (nl - p);
+	if (*len > 0 && p[*len - 1] == '\r')
+		*len -= 1;
+
+	return (nl < end) ? nl + 1 : end;
+}
+
+/**
+ * Finds the end of a quality line like next_line, while checking that every character
+ * before the line ending is one of the QUALITY_SYMBOLS quality values. Where SSE2 is
+ * available both tests are made on sixteen bytes at a time in a single pass
+ * @param bad Set to 1 if the line holds a character that is not a quality value
+ */
+static const char *next_quality_line(const char *p, const char *end, uint32_t *len, uint8_t *bad) {
+	const char *q = p;
+	const char *nl = NULL;
+	const char *first_bad = end;
+#if defined(__SSE2__) && defined(__GNUC__)
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i offset = _mm_set1_epi8(QUALITY_OFFSET);
+	const __m128i top = _mm_set1_epi8(QUALITY_SYMBOLS - 1);
+	__m128i v, x;
+	uint32_t nl_mask, bad_mask;
+
+	while (!nl && q + 16 <= end) {
+		v = _mm_loadu_si128((const __m128i *) q);
+		nl_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+
+		// Quality values map to 0..top after removing the offset, anything else is above it
+		x = _mm_sub_epi8(v, offset);
+		bad_mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(x, top), x)) & 0xffff;
+
+		if (nl_mask) {
+			nl = q + __builtin_ctz(nl_mask);
+			bad_mask &= (nl_mask & -nl_mask) - 1;
+		}
+		if (bad_mask && first_bad == end)
+			first_bad = q + __builtin_ctz(bad_mask);
+		q += 16;
+	}
+#endif
+
+	// Scalar tail, or the whole line without SSE2
+	if (!nl) {
+		for (; q < end && *q != '\n'; ++q) {
+			if (first_bad == end && (uint8_t) (*q - QUALITY_OFFSET) >= QUALITY_SYMBOLS)
+				first_bad = q;
+		}
+		nl = q;
+	}
+
+	*len = (uint32_t) (nl - p);
+	if (*len > 0 && p[*len - 1] == '\r')
+		*len -= 1;
+	*bad = (first_bad < p + *len) ? 1 : 0;
+
+	return (nl < end) ? nl + 1 : end;
+}
+
+/**
+ * Adds another line of the given length to the end of the block list, starting a new
+ * block when the last one is full, either of lines or (for long reads) of symbols. Used
+ * when the number of lines is not known in advance
+ */
+static struct line_t *append_line(struct quality_file_t *info, uint32_t length) {
+	struct line_block_t *block = NULL;
+
+	if (info->block_count > 0)
+		block = &info->blocks[info->block_count-1];
+
+	if (!block || block->count == MAX_LINES_PER_BLOCK || (block->count > 0 && block->symbols + length > MAX_SYMBOLS_PER_BLOCK)) {
+		// A block closed early only needs room for the lines it has
+		if (block && block->count < MAX_LINES_PER_BLOCK)
+			block->lines = (struct line_t *) realloc(block->lines, block->count*sizeof(struct line_t));
+
+		info->blocks = (struct line_block_t *) realloc(info->blocks, (info->block_count+1)*sizeof(struct line_block_t));
+		block = &info->blocks[info->block_count];
+		block->count = 0;
+		block->symbols = 0;
+		block->lines = (struct line_t *) calloc(MAX_LINES_PER_BLOCK, sizeof(struct line_t));
+		if (!block->lines)
+			return NULL;
+		info->block_count += 1;
+	}
+
+	block->count += 1;
+	block->symbols += length;
+	info->lines += 1;
+	return &block->lines[block->count-1];
+}
+
+/**
+ * Sets up an indexer that adds lines to an empty quality file structure
+ * @param fastq 1 if the input is FASTQ, 0 if it holds only quality lines
+ * @param max_lines Maximum number of lines to index, 0 for no limit
+ */
+void init_line_indexer(struct line_indexer_t *ix, struct quality_file_t *info, uint8_t fastq, uint64_t max_lines) {
+	ix->info = info;
+	ix->fastq = fastq;
+	ix->record_line = 0;
+	ix->seq_len = 0;
+	ix->line_number = 0;
+	ix->max_lines = max_lines;
+	ix->next = NULL;
+
+	info->columns = 0;
+	info->lines = 0;
+	info->symbols = 0;
+	info->block_count = 0;
+	info->blocks = NULL;
+	info->error_line = 0;
+}
+
+/**
+ * Indexes the complete lines in data[0..end), pointing each new line_t's m_data
+ * directly into the buffer, which must stay valid. For FASTQ input only the quality
+ * line of each record is indexed, and every record is walked using its own line
+ * lengths. Lines may have any length up to MAX_READS_PER_LINE, and the number of
+ * columns is the length of the longest. Every character of a quality line is checked
+ * as it is scanned, and on failure info->error_line names the first bad line
+ * @return LF_ERROR_NONE, or an error code for a malformed line
+ */
+uint32_t index_lines(struct line_indexer_t *ix, const char *data, const char *end) {
+	struct quality_file_t *info = ix->info;
+	const char *p = data, *line_start;
+	struct line_t *line;
+	uint32_t len;
+	uint32_t status = LF_ERROR_NONE;
+	uint8_t bad;
+
+	while (p < end && (ix->max_lines == 0 || info->lines < ix->max_lines)) {
+		line_start = p;
+		ix->line_number += 1;
+
+		if (ix->fastq && ix->record_line != 3) {
+			p = next_line(p, end, &len);
+			switch (ix->record_line) {
+				case 0:
+					// Header line
+					if (*line_start != '@')
+						status = LF_ERROR_BAD_FORMAT;
+					break;
+				case 1:
+					ix->seq_len = len;
+					break;
+				default:
+					// Separator line
+					if (*line_start != '+')
+						status = LF_ERROR_BAD_FORMAT;
+					break;
+			}
+			if (status != LF_ERROR_NONE)
+				break;
+
+			ix->record_line += 1;
+			continue;
+		}
+
+		// What remains is a quality line
+		p = next_quality_line(p, end, &len, &bad);
+		if (bad || (ix->fastq && len != ix->seq_len)) {
+			status = bad ? LF_ERROR_BAD_SYMBOL : LF_ERROR_BAD_FORMAT;
+			break;
+		}
+		if (len > MAX_READS_PER_LINE) {
+			status = LF_ERROR_TOO_LONG;
+			break;
+		}
+		if (len > info->columns)
+			info->columns = len;
+		ix->record_line = 0;
+
+		line = append_line(info, len);
+		if (!line)
+			return LF_ERROR_NO_MEMORY;
+		line->m_data = (const symbol_t *) line_start;
+		line->length = len;
+		info->symbols += len;
+	}
+
+	ix->next = p;
+	if (status != LF_ERROR_NONE)
+		info->error_line = ix->line_number;
+	return status;
+}
+
+/**
+ * Checks that the input ended cleanly after the last call to index_lines
+ */
+uint32_t finish_line_indexer(struct line_indexer_t *ix) {
+	if (ix->record_line != 0) {
+		// The last record is cut short
+		ix->info->error_line = ix->line_number + 1;
+		return LF_ERROR_BAD_FORMAT;
+	}
+	if (ix->info->columns == 0)
+		return LF_ERROR_BAD_FORMAT;
+	return LF_ERROR_NONE;
+}
+
+/**
+ * Loads a gzip compressed input, quality lines only or FASTQ. The file is inflated
+ * on a background thread while the chunks it produces are indexed here. The chunks
+ * hold the lines for the rest of the run, so they are kept in info->buffers
+ */
+static uint32_t load_gzip(const char *path, struct quality_file_t *info, uint64_t max_lines, uint8_t fastq) {
+	struct gz_reader_t *reader;
+	struct gz_chunk_t chunk;
+	struct line_indexer_t ix;
+	uint32_t status = LF_ERROR_NONE;
+	uint32_t close_status;
+	uint32_t threads = 1;
+
+	if (info->opts)
+		threads = info->opts->threads;
+
+	reader = gz_reader_open(path, threads, 0, 0);
+	if (!reader)
+		return LF_ERROR_NOT_SUPPORTED;
+
+	init_line_indexer(&ix, info, fastq, max_lines);
+	while (status == LF_ERROR_NONE && (max_lines == 0 || info->lines < max_lines) && gz_reader_next(reader, &chunk)) {
+		info->buffers = (char **) realloc(info->buffers, (info->buffer_count+1)*sizeof(char *));
+		info->buffers[info->buffer_count] = chunk.data;
+		info->buffer_count += 1;
+
+		status = index_lines(&ix, chunk.data, chunk.data + chunk.len);
+	}
+
+	close_status = gz_reader_close(reader);
+	if (status == LF_ERROR_NONE)
+		status = close_status;
+	if (status == LF_ERROR_NONE && (max_lines == 0 || info->lines < max_lines))
+		status = finish_line_indexer(&ix);
+
+	return status;
+}
+
+/**
+ * Indexes the quality lines of a FASTQ file directly, without copying them out first.
+ * The file is mapped and every record is walked using its own line lengths, so
+ * headers and sequences may be any length, and each line's m_data points at the
+ * fourth line of its record. Each quality line must match its sequence in length. Gzip
+ * compressed files are inflated into memory instead
+ * @param path Path of the FASTQ file to read
+ * @param info Information structure to store in, this must be a valid pointer already
+ * @param max_lines Maximum number of records to read, will override the actual number in the file if >0
+ */
+uint32_t load_fastq(const char *path, struct quality_file_t *info, uint64_t max_lines) {
+	info->path = strdup(path);
+	info->buffers = NULL;
+	info->buffer_count = 0;
+	info->map = NULL;
+	info->map_size = 0;
+	info->error_line = 0;
+
+	if (is_gzip_file(path))
+		return load_gzip(path, info, max_lines, 1);
 
-	// Use the first line to figure out how long the file is
-	fgets(line, READ_LINEBUF_LENGTH, fp);
-	info->columns = strlen(line) - 1;
-	if (info->columns > MAX_READS_PER_LINE) {
-		fclose(fp);
-		return LF_ERROR_TOO_LONG;
+	return load_mapped(path, info, max_lines, 1);
+}
+
+/**
+ * Copies a stream to a new temporary file in $TMPDIR (or /tmp), for input such as
+ * standard input that cannot be mapped or read twice. The caller unlinks the file
+ * @param fp Stream to read until EOF
+ * @param path Receives the path of the temporary file
+ */
+uint32_t spill_stream(FILE *fp, char *path, size_t path_len) {
+	const char *tmpdir = getenv("TMPDIR");
+	char *buf;
+	size_t len;
+	int fd;
+	uint32_t status = LF_ERROR_NONE;
+
+	if (!tmpdir || !*tmpdir)
+		tmpdir = "/tmp";
+	snprintf(path, path_len, "%s/qvzXXXXXX", tmpdir);
+	fd = mkstemp(path);
+	if (fd == -1)
+		return LF_ERROR_NOT_FOUND;
+
+	buf = (char *) malloc(STREAM_SPILL_LENGTH);
+	if (!buf) {
+		close(fd);
+		unlink(path);
+		return LF_ERROR_NO_MEMORY;
 	}
-	fclose(fp);
 
-	// Figure out how many lines we'll need depending on whether we were limited or not
-	_stat(path, &finfo);
-	info->lines = finfo.st_size / ((uint64_t) (info->columns+1));
-	if (max_lines > 0 && info->lines > max_lines) {
-		info->lines = max_lines;
+	while ((len = fread(buf, 1, STREAM_SPILL_LENGTH, fp)) > 0) {
+		if (write(fd, buf, len) != (ssize_t) len) {
+			status = LF_ERROR_NO_MEMORY;
+			break;
+		}
 	}
-	
-	status = alloc_blocks(info);
+	free(buf);
+	close(fd);
+
+	if (status != LF_ERROR_NONE)
+		unlink(path);
+	return status;
+}
+
+/**
+ * Loads input that cannot be mapped directly, such as standard input. The stream is
+ * copied to a temporary file, which is then loaded like any other input (so it may
+ * also be gzip compressed). The file is unlinked once it has been loaded, and its
+ * space is released when qvz exits
+ * @param fp Stream to read until EOF
+ * @param fastq 1 if the stream is a FASTQ file, 0 if it holds only quality lines
+ */
+uint32_t load_stream(FILE *fp, struct quality_file_t *info, uint64_t max_lines, uint8_t fastq) {
+	char path[4096];
+	uint32_t status;
+
+	status = spill_stream(fp, path, sizeof(path));
 	if (status != LF_ERROR_NONE)
 		return status;
 
-	// mmap the file to set up constant pointers indexing it
-	file_mmap = mmap(NULL, finfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (fastq)
+		status = load_fastq(path, info, max_lines);
+	else
+		status = load_file(path, info, max_lines);
+
+	unlink(path);
+	return status;
+}
+
+/**
+ * Picks the reservoir slot for the line numbered i (from 0) once the reservoir is full.
+ * A result of count or more means the line is not kept, so each line is kept with
+ * probability count/(i+1)
+ */
+static uint64_t reservoir_slot(uint64_t i) {
+	return (((uint64_t) rand() << 31) | (uint64_t) rand()) % (i + 1);
+}
+
+/**
+ * Draws a uniform random sample of lines with reservoir sampling, for training on
+ * input too large to cluster in full. The sample shares the lines' data with info
+ * @param sample Receives the sampled lines, along with the settings copied from info
+ * @param count Number of lines to sample, all lines are taken if there are fewer
+ */
+uint32_t sample_lines(struct quality_file_t *info, struct quality_file_t *sample, uint64_t count) {
+	uint64_t i, j;
+	uint32_t status, block, line_idx;
+	struct line_t *line;
 
-	// Process the file
-	block_idx = 0;
-	line_idx = 0;
-	while ((block_idx * MAX_LINES_PER_BLOCK + line_idx) < info->lines) {
-		// Setting up mmap indexing assumes we have only one line ending!
-		info->blocks[block_idx].lines[line_idx].m_data = file_mmap + ((uint64_t) (block_idx * MAX_LINES_PER_BLOCK + line_idx)) * (info->columns+1);
+	memcpy(sample, info, sizeof(struct quality_file_t));
+	sample->lines = (info->lines < count) ? info->lines : count;
+	sample->symbols = 0;
+	sample->buffers = NULL;
+	sample->buffer_count = 0;
+	sample->map = NULL;
 
-		// Increment line/block pointers as necesary
-		line_idx += 1;
-		if (line_idx == info->blocks[block_idx].count) {
-			line_idx = 0;
-			block_idx += 1;
+	status = alloc_blocks(sample);
+	if (status != LF_ERROR_NONE)
+		return status;
+
+	i = 0;
+	for (block = 0; block < info->block_count; ++block) {
+		for (line_idx = 0; line_idx < info->blocks[block].count; ++line_idx, ++i) {
+			line = &info->blocks[block].lines[line_idx];
+			if (i < sample->lines) {
+				j = i;
+			}
+			else {
+				j = reservoir_slot(i);
+				if (j >= sample->lines)
+					continue;
+			}
+			sample->blocks[j / MAX_LINES_PER_BLOCK].lines[j % MAX_LINES_PER_BLOCK] = *line;
 		}
 	}
 
+	for (i = 0; i < sample->lines; ++i) {
+		sample->symbols += sample->blocks[i / MAX_LINES_PER_BLOCK].lines[i % MAX_LINES_PER_BLOCK].length;
+	}
+
 	return LF_ERROR_NONE;
 }
 
@@ -91,7 +543,7 @@ uint32_t alloc_blocks(struct quality_file_t *info) {
 
 	// Figure out how many blocks we'll need to store this file
 	info->block_count = (uint32_t) (info->lines / (uint64_t)MAX_LINES_PER_BLOCK);
-	if (info->block_count * MAX_LINES_PER_BLOCK != info->lines) {
+	if (((uint64_t) info->block_count) * MAX_LINES_PER_BLOCK != info->lines) {
 		info->block_count += 1;
 	}
 
@@ -137,4 +589,312 @@ void free_blocks(struct quality_file_t *info) {
 		free(info->blocks[i].lines);
 	}
 	free(info->blocks);
+
+	// Inflated or mapped input that the lines pointed into
+	for (i = 0; i < info->buffer_count; ++i) {
+		free(info->buffers[i]);
+	}
+	free(info->buffers);
+	if (info->map)
+		munmap(info->map, info->map_size);
+}
+
+/**
+ * Opens an input to be read a window at a time with next_line_window
+ * @param window Bytes to map at a time, raised to MIN_WINDOW_LENGTH if smaller
+ * @param max_lines Lines to index at most per window, 0 for no limit
+ * @param fastq 1 if the input is FASTQ, 0 if it holds only quality lines
+ * @param threads Threads used to inflate gzip input
+ */
+uint32_t open_line_windows(struct line_window_t *w, const char *path, uint64_t window, uint64_t max_lines, uint8_t fastq, uint32_t threads) {
+	struct _stat finfo;
+
+	memset(w, 0, sizeof(struct line_window_t));
+	w->path = strdup(path);
+	w->fd = -1;
+	w->fastq = fastq;
+	w->threads = threads;
+	w->page = sysconf(_SC_PAGESIZE);
+	w->window = (window < MIN_WINDOW_LENGTH) ? MIN_WINDOW_LENGTH : window;
+	w->window = (w->window + w->page - 1) / w->page * w->page;
+	w->max_lines = max_lines;
+
+	w->gzip = is_gzip_file(path);
+	if (w->gzip)
+		return rewind_line_windows(w);
+
+	w->fd = open(path, O_RDONLY);
+	if (w->fd == -1)
+		return LF_ERROR_NOT_FOUND;
+	fstat(w->fd, &finfo);
+	if (finfo.st_size == 0)
+		return LF_ERROR_BAD_FORMAT;
+	w->file_size = finfo.st_size;
+
+	return rewind_line_windows(w);
+}
+
+/**
+ * Goes back to the start of the input, so that it can be read again
+ */
+uint32_t rewind_line_windows(struct line_window_t *w) {
+	w->ix.info = NULL;
+	w->ix.fastq = w->fastq;
+	w->ix.record_line = 0;
+	w->ix.seq_len = 0;
+	w->ix.line_number = 0;
+	w->ix.max_lines = w->max_lines;
+	w->offset = 0;
+	w->done = 0;
+	free(w->chunk);
+	w->chunk = NULL;
+	w->chunk_len = 0;
+	w->chunk_pos = 0;
+
+	if (w->gzip) {
+		if (w->gz)
+			gz_reader_close(w->gz);
+		// The chunk being indexed, the one waiting and the one being inflated take about
+		// a window between them
+		w->gz = gz_reader_open(w->path, w->threads, w->window / 4, 1);
+		if (!w->gz)
+			return LF_ERROR_NOT_SUPPORTED;
+	}
+
+	return LF_ERROR_NONE;
+}
+
+/**
+ * Indexes the next window of the input into win, whose lines point into memory that
+ * win owns until free_blocks, or for gzip input that w holds until the next call.
+ * Settings such as the clusters and the WELL seed are copied from info. Line numbers
+ * in errors count from the start of the input
+ * @return LF_ERROR_NONE, with win->lines set to 0 once the input is used up
+ */
+uint32_t next_line_window(struct line_window_t *w, struct quality_file_t *info, struct quality_file_t *win) {
+	struct gz_chunk_t chunk;
+	const char *data, *start, *end;
+	uint64_t map_start, map_len;
+	uint32_t status;
+
+	memcpy(win, info, sizeof(struct quality_file_t));
+	win->lines = 0;
+	win->columns = 0;
+	win->symbols = 0;
+	win->block_count = 0;
+	win->blocks = NULL;
+	win->buffers = NULL;
+	win->buffer_count = 0;
+	win->map = NULL;
+	win->map_size = 0;
+	win->error_line = 0;
+	w->ix.info = win;
+
+	if (w->done)
+		return LF_ERROR_NONE;
+
+	// A chunk is kept until the line limit has let all of its lines through
+	if (w->gzip && w->chunk_pos == w->chunk_len) {
+		free(w->chunk);
+		w->chunk = NULL;
+		w->chunk_len = 0;
+		w->chunk_pos = 0;
+		if (gz_reader_next(w->gz, &chunk)) {
+			w->chunk = chunk.data;
+			w->chunk_len = chunk.len;
+		}
+	}
+	if (w->gzip && w->chunk) {
+		status = index_lines(&w->ix, w->chunk + w->chunk_pos, w->chunk + w->chunk_len);
+		w->chunk_pos = w->ix.next - w->chunk;
+		return status;
+	}
+
+	// At the end of the input, the last FASTQ record must be complete
+	if (w->gzip || w->offset >= w->file_size) {
+		w->done = 1;
+		status = LF_ERROR_NONE;
+		if (w->gzip) {
+			status = gz_reader_close(w->gz);
+			w->gz = NULL;
+		}
+		if (status == LF_ERROR_NONE && w->ix.record_line != 0) {
+			win->error_line = w->ix.line_number + 1;
+			status = LF_ERROR_BAD_FORMAT;
+		}
+		return status;
+	}
+
+	// Mappings start on a page boundary, so the window may begin partway into its first page
+	map_start = w->offset / w->page * w->page;
+	map_len = w->file_size - map_start;
+	if (map_len > w->window)
+		map_len = w->window;
+	win->map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, w->fd, map_start);
+	if (win->map == MAP_FAILED) {
+		win->map = NULL;
+		return LF_ERROR_NO_MEMORY;
+	}
+	win->map_size = map_len;
+	madvise(win->map, map_len, MADV_SEQUENTIAL);
+	madvise(win->map, map_len, MADV_WILLNEED);
+
+	data = (const char *) win->map;
+	start = data + (w->offset - map_start);
+	end = data + map_len;
+
+	// Only whole lines are indexed, unless this is the end of the input
+	if (map_start + map_len < w->file_size) {
+		while (end > start && end[-1] != '\n')
+			end -= 1;
+		if (end == start) {
+			win->error_line = w->ix.line_number + 1;
+			return LF_ERROR_TOO_LONG;
+		}
+	}
+	status = index_lines(&w->ix, start, end);
+	w->offset = map_start + (w->ix.next - data);
+
+	return status;
+}
+
+/**
+ * Closes windowed input
+ */
+void close_line_windows(struct line_window_t *w) {
+	free(w->chunk);
+	if (w->gz)
+		gz_reader_close(w->gz);
+	if (w->fd != -1)
+		close(w->fd);
+	free(w->path);
+}
+
+/**
+ * Bytes that a sampled line of the given length takes: its line_t, the pointer to its
+ * copy, and the copy as glibc's malloc allocates it, with a header and in 16 byte steps
+ */
+static uint64_t sample_line_cost(uint64_t length) {
+	uint64_t copy = (length + 1 + sizeof(size_t) + 15) / 16 * 16;
+
+	if (copy < 32)
+		copy = 32;
+	return copy + sizeof(struct line_t) + sizeof(char *);
+}
+
+/**
+ * Reads a windowed input through once, finding its line count, symbol count and longest
+ * line, and drawing a uniform random sample of its lines for training with reservoir
+ * sampling. The sampled lines are copied, since the windows are released as the scan
+ * goes. The sample size is fixed from the first window so that the copies, with their
+ * line_t and malloc's rounding, take about budget bytes, and the input is rewound for
+ * encoding afterwards
+ * @param info Receives the totals for the whole input
+ * @param sample Receives the sampled lines, along with the settings copied from info
+ * @param budget Bytes of line data the sample should hold
+ */
+uint32_t scan_line_windows(struct line_window_t *w, struct quality_file_t *info, struct quality_file_t *sample, uint64_t budget) {
+	struct quality_file_t win;
+	struct line_t *slots = NULL, *line;
+	char **copies = NULL;
+	uint64_t capacity = 0, seen = 0, i, j;
+	uint32_t status, block, line_idx;
+
+	info->lines = 0;
+	info->columns = 0;
+	info->symbols = 0;
+	info->block_count = 0;
+	info->blocks = NULL;
+	info->buffers = NULL;
+	info->buffer_count = 0;
+	info->map = NULL;
+	info->map_size = 0;
+	info->error_line = 0;
+
+	while (1) {
+		status = next_line_window(w, info, &win);
+		if (status != LF_ERROR_NONE || win.lines == 0)
+			break;
+
+		if (!slots) {
+			capacity = budget / sample_line_cost(win.symbols / win.lines);
+			if (capacity > STREAM_SAMPLE_LINES)
+				capacity = STREAM_SAMPLE_LINES;
+			if (capacity < 1)
+				capacity = 1;
+			slots = (struct line_t *) calloc(capacity, sizeof(struct line_t));
+			copies = (char **) calloc(capacity, sizeof(char *));
+			if (!slots || !copies) {
+				status = LF_ERROR_NO_MEMORY;
+				break;
+			}
+		}
+
+		for (block = 0; block < win.block_count; ++block) {
+			for (line_idx = 0; line_idx < win.blocks[block].count; ++line_idx, ++seen) {
+				line = &win.blocks[block].lines[line_idx];
+				j = (seen < capacity) ? seen : reservoir_slot(seen);
+				if (j >= capacity)
+					continue;
+
+				free(copies[j]);
+				copies[j] = (char *) malloc(line->length + 1);
+				memcpy(copies[j], line->m_data, line->length);
+				slots[j] = *line;
+				slots[j].m_data = (const symbol_t *) copies[j];
+			}
+		}
+
+		info->lines += win.lines;
+		info->symbols += win.symbols;
+		if (win.columns > info->columns)
+			info->columns = win.columns;
+		free_blocks(&win);
+	}
+
+	if (status != LF_ERROR_NONE) {
+		info->error_line = win.error_line;
+		free_blocks(&win);
+	}
+	else if (info->columns == 0) {
+		status = LF_ERROR_BAD_FORMAT;
+	}
+	else {
+		status = rewind_line_windows(w);
+	}
+
+	if (status == LF_ERROR_NONE) {
+		memcpy(sample, info, sizeof(struct quality_file_t));
+		sample->lines = (seen < capacity) ? seen : capacity;
+		sample->symbols = 0;
+		sample->buffers = copies;
+		sample->buffer_count = (uint32_t) sample->lines;
+		sample->map = NULL;
+
+		// The sample fits in a single block, so the slots become its lines instead of
+		// being copied into new ones
+		sample->block_count = 1;
+		sample->blocks = (struct line_block_t *) calloc(1, sizeof(struct line_block_t));
+		if (!sample->blocks)
+			status = LF_ERROR_NO_MEMORY;
+	}
+
+	if (status == LF_ERROR_NONE) {
+		for (i = 0; i < sample->lines; ++i) {
+			sample->symbols += slots[i].length;
+		}
+		sample->blocks[0].count = (uint32_t) sample->lines;
+		sample->blocks[0].symbols = sample->symbols;
+		sample->blocks[0].lines = slots;
+		slots = NULL;
+	}
+	else if (copies) {
+		for (i = 0; i < capacity; ++i) {
+			free(copies[i]);
+		}
+		free(copies);
+	}
+	free(slots);
+
+	return status;
 }
@@ -10,17 +10,22 @@
 #include "qv_compressor.h"
 #include "cluster.h"
 
-#define ALPHABET_SIZE 72
+#define ALPHABET_SIZE QUALITY_SYMBOLS
 
 /**
  *
  */
 void encode(char *input_name, char *output_name, struct qv_options_t *opts) {
-	struct quality_file_t qv_info;
+	struct quality_file_t qv_info, sample, win;
+	struct quality_file_t *training;
+	struct line_window_t windows;
+	struct qv_encoder_t enc;
+	char spill_path[4096];
+	uint8_t spilled = 0;
 	struct distortion_t *dist;
 	struct alphabet_t *alphabet = alloc_alphabet(ALPHABET_SIZE);
-	uint32_t status;
-	struct hrtimer_t cluster_time, stats, encoding, total;
+	uint32_t status = LF_ERROR_NONE, i;
+	struct hrtimer_t load, cluster_time, stats, encoding, total;
 	FILE *fout, *funcompressed = NULL;
 	uint64_t bytes_used;
     double distortion;
@@ -37,21 +42,81 @@ void encode(char *input_name, char *output_name, struct qv_options_t *opts) {
 	qv_info.alphabet = alphabet;
 	qv_info.dist = dist;
 	qv_info.cluster_count = opts->clusters;
+	qv_info.coder = opts->coder;
+	qv_info.lanes = opts->lanes;
+	qv_info.estimator = opts->estimator;
+	qv_info.opts = opts;
 
-	// Load input file all at once
-	status = load_file(input_name, &qv_info, 0);
+	// Load input file all at once, a pipe is spilled to a temporary file first. Under a
+	// memory limit the input is only scanned here, a window at a time, and a sample of it
+	// is kept for training. It is read again for coding. The limit is shared out in
+	// quarters: the mapped window, the line_t records of its lines, and the training
+	// sample while scanning. While coding, the window's coded blocks and -u text are each
+	// smaller than the window, and are written out before the next window is read
+	start_timer(&load);
+	if (opts->mem_limit) {
+#ifdef LINUX
+		// Large buffers always get their own mapping, which goes back to the system when
+		// they are freed. Otherwise glibc raises its threshold after the first such free,
+		// and later windows' buffers come from the heap and are zeroed there in full
+		mallopt(M_MMAP_THRESHOLD, 1 << 20);
+#endif
+		if (strcmp(input_name, "-") == 0) {
+			status = spill_stream(stdin, spill_path, sizeof(spill_path));
+			input_name = spill_path;
+			spilled = (status == LF_ERROR_NONE);
+		}
+		qv_info.error_line = 0;
+		if (status == LF_ERROR_NONE)
+			status = open_line_windows(&windows, input_name, opts->mem_limit / 4, opts->mem_limit / 4 / sizeof(struct line_t), opts->fastq, opts->threads);
+		if (status == LF_ERROR_NONE)
+			status = scan_line_windows(&windows, &qv_info, &sample, opts->mem_limit / 4);
+	}
+	else if (strcmp(input_name, "-") == 0)
+		status = load_stream(stdin, &qv_info, 0, opts->fastq);
+	else if (opts->fastq)
+		status = load_fastq(input_name, &qv_info, 0);
+	else
+		status = load_file(input_name, &qv_info, 0);
 	if (status != LF_ERROR_NONE) {
+		if (qv_info.error_line)
+			printf("Input line %llu is malformed.\n", (unsigned long long) qv_info.error_line);
 		printf("load_file returned error: %d\n", status);
+		if (spilled)
+			unlink(spill_path);
 		exit(1);
 	}
+	stop_timer(&load);
+	if (opts->verbose) {
+		printf("Loading took %.4f seconds\n", get_timer_interval(&load));
+	}
+
+	// Input from a pipe is trained on a bounded sample of its lines
+	training = &qv_info;
+	if (opts->mem_limit) {
+		training = &sample;
+		if (opts->verbose) {
+			printf("Training on %llu of %llu lines, coding in windows of %llu bytes.\n", (unsigned long long) sample.lines, (unsigned long long) qv_info.lines, (unsigned long long) windows.window);
+		}
+	}
+	else if (strcmp(input_name, "-") == 0 && qv_info.lines > STREAM_SAMPLE_LINES) {
+		status = sample_lines(&qv_info, &sample, STREAM_SAMPLE_LINES);
+		if (status != LF_ERROR_NONE) {
+			printf("sample_lines returned error: %d\n", status);
+			exit(1);
+		}
+		training = &sample;
+		if (opts->verbose) {
+			printf("Training on %llu of %llu lines.\n", (unsigned long long) sample.lines, (unsigned long long) qv_info.lines);
+		}
+	}
 
 	// Set up clustering data structures
-	qv_info.clusters = alloc_cluster_list(&qv_info);
-	qv_info.opts = opts;
+	training->clusters = alloc_cluster_list(training);
 
 	// Do k-means clustering
 	start_timer(&cluster_time);
-	do_kmeans_clustering(&qv_info);
+	do_kmeans_clustering(training);
 	stop_timer(&cluster_time);
 	if (opts->verbose) {
 		printf("Clustering took %.4f seconds\n", get_timer_interval(&cluster_time));
@@ -59,9 +124,18 @@ void encode(char *input_name, char *output_name, struct qv_options_t *opts) {
     
 	// Then find stats and generate codebooks for each cluster
 	start_timer(&stats);
-	calculate_statistics(&qv_info);
-	generate_codebooks(&qv_info);
+	calculate_statistics(training);
+	generate_codebooks(training);
 	stop_timer(&stats);
+
+	// Lines outside the sample still need to be assigned to the nearest cluster
+	if (training != &qv_info) {
+		qv_info.clusters = sample.clusters;
+		for (i = 0; i < qv_info.block_count; ++i) {
+			cluster_lines(&qv_info.blocks[i], &qv_info);
+		}
+		free_blocks(&sample);
+	}
     
 	if (opts->verbose) {
 		printf("Stats and codebook generation took %.4f seconds\n", get_timer_interval(&stats));
@@ -88,11 +162,40 @@ void encode(char *input_name, char *output_name, struct qv_options_t *opts) {
 	// @todo qv_compression should use quality_file structure with data in memory, now
 	start_timer(&encoding);
 	write_codebooks(fout, &qv_info);
-    bytes_used = start_qv_compression(&qv_info, fout, &distortion, funcompressed);
+	if (opts->mem_limit) {
+		// Each window is assigned to clusters, coded and released before the next is read
+		begin_qv_compression(&enc, &qv_info, fout, funcompressed);
+		while ((status = next_line_window(&windows, &qv_info, &win)) == LF_ERROR_NONE && win.lines > 0) {
+			win.columns = qv_info.columns;
+			for (i = 0; i < win.block_count; ++i) {
+				cluster_lines(&win.blocks[i], &win);
+			}
+			compress_qv_blocks(&enc, &win);
+			free_blocks(&win);
+		}
+		if (status != LF_ERROR_NONE) {
+			printf("Input changed while it was being encoded (error %d).\n", status);
+			if (spilled)
+				unlink(spill_path);
+			exit(1);
+		}
+		bytes_used = finish_qv_compression(&enc, &distortion);
+		close_line_windows(&windows);
+		if (spilled)
+			unlink(spill_path);
+	}
+	else {
+		bytes_used = start_qv_compression(&qv_info, fout, &distortion, funcompressed);
+	}
 	stop_timer(&encoding);
 	stop_timer(&total);
 
 	fclose(fout);
+	if (funcompressed)
+		fclose(funcompressed);
+
+	// The lines (and the mapping of the input behind them) are no longer needed
+	free_blocks(&qv_info);
     
 	// Verbose stats
 	if (opts->verbose) {
@@ -113,16 +216,18 @@ void encode(char *input_name, char *output_name, struct qv_options_t *opts) {
             default:
                 break;
         }
-		printf("Lines: %llu\n", qv_info.lines);
-		printf("Columns: %u\n", qv_info.columns);
-		printf("Total bytes used: %llu\n", bytes_used);
+		printf("Lines: %llu\n", (unsigned long long) qv_info.lines);
+		printf("Columns: %u (longest line)\n", qv_info.columns);
+		printf("Quality values: %llu\n", (unsigned long long) qv_info.symbols);
+		printf("Total bytes used: %llu\n", (unsigned long long) bytes_used);
 		printf("Encoding took %.4f seconds.\n", get_timer_interval(&total));
 		printf("Total time elapsed: %.4f seconds.\n", get_timer_interval(&total));
+		printf("Peak resident memory: %llu MB\n", (unsigned long long) (peak_resident_memory() >> 20));
 	}
 
 	// Parse-able stats
 	if (opts->stats) {
-		printf("rate, %.4f, distortion, %.4f, time, %.4f, size, %llu \n", (bytes_used*8.)/((double)(qv_info.lines)*qv_info.columns), distortion, get_timer_interval(&total), bytes_used);
+		printf("rate, %.4f, distortion, %.4f, time, %.4f, size, %llu \n", (bytes_used*8.)/((double) qv_info.symbols), distortion, get_timer_interval(&total), (unsigned long long) bytes_used);
 	}
 }
 
@@ -131,9 +236,11 @@ void encode(char *input_name, char *output_name, struct qv_options_t *opts) {
  */
 void decode(char *input_file, char *output_file, struct qv_options_t *opts) {
 	FILE *fin, *fout;
+	FILE *fheaders = NULL, *fsequences = NULL;
 	struct hrtimer_t timer;
 	struct quality_file_t qv_info;
 	struct alphabet_t *A = alloc_alphabet(ALPHABET_SIZE);
+	uint64_t first_line, last_line;
     
 	qv_info.alphabet = A;
 	qv_info.opts = opts;
@@ -141,21 +248,54 @@ void decode(char *input_file, char *output_file, struct qv_options_t *opts) {
 	start_timer(&timer);
 
 	fin = fopen(input_file, "rb");
-	fout = fopen(output_file, "wt");
+	if (strcmp(output_file, "-") == 0)
+		fout = stdout;
+	else
+		fout = fopen(output_file, "wt");
 	if (!fin || !fout) {
 		perror("Unable to open input or output files");
 		exit(1);
 	}
 
+	if (opts->headers_name || opts->sequences_name) {
+		if (!opts->headers_name || !opts->sequences_name) {
+			printf("Both --headers and --sequences are needed to write FASTQ.\n");
+			exit(1);
+		}
+		fheaders = fopen(opts->headers_name, "rt");
+		fsequences = fopen(opts->sequences_name, "rt");
+		if (!fheaders || !fsequences) {
+			perror("Unable to open header or sequence files");
+			exit(1);
+		}
+	}
+
 	read_codebooks(fin, &qv_info);
-    start_qv_decompression(fout, fin, &qv_info);
 
+	// Work out which lines to decode, zero based and inclusive
+	first_line = 0;
+	last_line = qv_info.lines - 1;
+	if (opts->range) {
+		if (opts->range_start < 1 || opts->range_start > opts->range_end || opts->range_end > qv_info.lines) {
+			printf("Range %llu:%llu is outside the %llu lines in the file.\n", (unsigned long long) opts->range_start, (unsigned long long) opts->range_end, (unsigned long long) qv_info.lines);
+			exit(1);
+		}
+		first_line = opts->range_start - 1;
+		last_line = opts->range_end - 1;
+	}
+
+    start_qv_decompression(fout, fin, &qv_info, first_line, last_line, fheaders, fsequences);
+
+	if (fheaders) {
+		fclose(fheaders);
+		fclose(fsequences);
+	}
 	fclose(fout);
 	fclose(fin);
 	stop_timer(&timer);
 
 	if (opts->verbose) {
-		printf("Decoded %llu lines in %f seconds.\n", qv_info.lines, get_timer_interval(&timer));
+		printf("Decoded %llu lines in %f seconds.\n", (unsigned long long) (last_line - first_line + 1), get_timer_interval(&timer));
 	}
 }
 
@@ -165,15 +305,32 @@ void decode(char *input_file, char *output_file, struct qv_options_t *opts) {
  */
 void usage(char *name) {
 	printf("Usage: %s (options) [input file] [output file]\n", name);
+	printf("Use - as the input file to encode from standard input, or as the output file to decode to standard output\n");
 	printf("Options are:\n");
 	printf("   -q           : Store quality values in compressed file (default)\n");
+	printf("   --fastq      : Input is a FASTQ file, compress its quality lines directly\n");
 	printf("   -x           : Extract quality values from compressed file\n");
+	printf("   --range S:E  : With -x, only extract lines S through E (numbered from 1, inclusive; both must lie within the file)\n");
+	printf("   --headers [FILE] --sequences [FILE]\n");
+	printf("                : With -x, write FASTQ using the header and sequence lines (one per read) from these files\n");
 	printf("   -f [ratio]   : Compress using [ratio] bits per bit of input entropy per symbol\n");
 	printf("   -r [rate]    : Compress using fixed [rate] bits per symbol\n");
     printf("   -d [M|L|A]   : Optimize for MSE, Log(1+L1), L1 distortions, respectively (default: MSE)\n");
 	printf("   -D [FILE]    : Optimize using the custom distortion matrix specified in FILE\n");
 	printf("   -c [#]       : Compress using [#] clusters (default: 1)\n");
 	printf("   -T [#]       : Use [#] as a threshold for cluster center movement (L2 norm) to declare a stable solution (default: 4).\n");
+	printf("   --coder [arith|range|rans|tans|binary]\n");
+	printf("                : Code the quantized values with the bitwise arithmetic coder (default), the faster bytewise range coder,\n");
+	printf("                  adaptive rANS, two pass tANS with fixed tables per block (fastest to decode on short lines,\n");
+	printf("                  or on long ones with --lanes), or adaptive binary decisions (is it the context's most common\n");
+	printf("                  value, and if not which one) on the range coder\n");
+	printf("   --estimator [count|mixed|state]\n");
+	printf("                : Adapt the coders' statistics with fixed steps (default), a mix of fast and slow counts,\n");
+	printf("                  or steps that shrink as each context sees more values\n");
+	printf("   --lanes [#]  : With rans or tans, spread each group of [#] consecutive lines over [#] interleaved coder states (default: 1, at most %d)\n", QV_MAX_LANES);
+	printf("   --mem-limit [MB]\n");
+	printf("                : Encode the input a window at a time, keeping the memory used for it near [MB] megabytes\n");
+	printf("   -t [#]       : Encode or decode [#] line blocks in parallel using [#] threads (default: 1)\n");
     printf("   -u [FILE]    : Write the uncompressed lossy values to FILE (default: off)\n");
 	printf("   -h           : Print this help\n");
 	printf("   -s           : Print summary stats\n");
@@ -191,6 +348,7 @@ int main(int argc, char **argv) {
 	char *output_name = 0;
 	struct qv_options_t opts;
 	uint32_t i;
+	char *range_sep;
 
 	uint8_t extract = 0;
 	uint8_t file_idx = 0;
@@ -202,13 +360,22 @@ int main(int argc, char **argv) {
     opts.uncompressed = 0;
     opts.distortion = DISTORTION_MSE;
 	opts.cluster_threshold = 4;
+	opts.threads = 1;
+	opts.range = 0;
+	opts.mem_limit = 0;
+	opts.coder = QV_CODER_ARITH;
+	opts.lanes = 1;
+	opts.estimator = QV_ESTIMATOR_COUNT;
+	opts.fastq = 0;
+	opts.headers_name = NULL;
+	opts.sequences_name = NULL;
 
 	// No dependency, cross-platform command line parsing means no getopt
 	// So we need to settle for less than optimal flexibility (no combining short opts, maybe that will be added later)
 	i = 1;
 	while (i < argc) {
-		// Handle file names and reject any other untagged arguments
-		if (argv[i][0] != '-') {
+		// Handle file names (- is standard input or output) and reject any other untagged arguments
+		if (argv[i][0] != '-' || argv[i][1] == '\0') {
 			switch (file_idx) {
 				case 0:
 					input_name = argv[i];
@@ -227,6 +394,84 @@ int main(int argc, char **argv) {
 			continue;
 		}
 
+		// Long options
+		if (argv[i][1] == '-') {
+			if (strcmp(argv[i], "--fastq") == 0) {
+				opts.fastq = 1;
+				i += 1;
+			}
+			else if (strcmp(argv[i], "--headers") == 0 && i+1 < argc) {
+				opts.headers_name = argv[i+1];
+				i += 2;
+			}
+			else if (strcmp(argv[i], "--sequences") == 0 && i+1 < argc) {
+				opts.sequences_name = argv[i+1];
+				i += 2;
+			}
+			else if (strcmp(argv[i], "--mem-limit") == 0 && i+1 < argc) {
+				opts.mem_limit = strtoull(argv[i+1], NULL, 10) << 20;
+				if (opts.mem_limit < 4*MIN_WINDOW_LENGTH) {
+					printf("The memory limit must be at least %d MB.\n", (4*MIN_WINDOW_LENGTH) >> 20);
+					exit(1);
+				}
+				i += 2;
+			}
+			else if (strcmp(argv[i], "--coder") == 0 && i+1 < argc) {
+				if (strcmp(argv[i+1], "arith") == 0)
+					opts.coder = QV_CODER_ARITH;
+				else if (strcmp(argv[i+1], "range") == 0)
+					opts.coder = QV_CODER_RANGE;
+				else if (strcmp(argv[i+1], "rans") == 0)
+					opts.coder = QV_CODER_RANS;
+				else if (strcmp(argv[i+1], "tans") == 0)
+					opts.coder = QV_CODER_TANS;
+				else if (strcmp(argv[i+1], "binary") == 0)
+					opts.coder = QV_CODER_BINARY;
+				else {
+					printf("Unknown coder %s, expected arith, range, rans, tans or binary.\n", argv[i+1]);
+					exit(1);
+				}
+				i += 2;
+			}
+			else if (strcmp(argv[i], "--estimator") == 0 && i+1 < argc) {
+				if (strcmp(argv[i+1], "count") == 0)
+					opts.estimator = QV_ESTIMATOR_COUNT;
+				else if (strcmp(argv[i+1], "mixed") == 0)
+					opts.estimator = QV_ESTIMATOR_MIXED;
+				else if (strcmp(argv[i+1], "state") == 0)
+					opts.estimator = QV_ESTIMATOR_STATE;
+				else {
+					printf("Unknown estimator %s, expected count, mixed or state.\n", argv[i+1]);
+					exit(1);
+				}
+				i += 2;
+			}
+			else if (strcmp(argv[i], "--lanes") == 0 && i+1 < argc) {
+				opts.lanes = atoi(argv[i+1]);
+				if (opts.lanes < 1 || opts.lanes > QV_MAX_LANES) {
+					printf("The number of lanes must be from 1 to %d.\n", QV_MAX_LANES);
+					exit(1);
+				}
+				i += 2;
+			}
+			else if (strcmp(argv[i], "--range") == 0 && i+1 < argc) {
+				opts.range = 1;
+				opts.range_start = strtoull(argv[i+1], &range_sep, 10);
+				if (*range_sep != ':') {
+					printf("Range must be given as START:END.\n");
+					exit(1);
+				}
+				opts.range_end = strtoull(range_sep+1, NULL, 10);
+				i += 2;
+			}
+			else {
+				printf("Unrecognized option %s.\n", argv[i]);
+				usage(argv[0]);
+				exit(1);
+			}
+			continue;
+		}
+
 		// Flags for options
 		switch(argv[i][1]) {
 			case 'x':
@@ -273,6 +518,12 @@ int main(int argc, char **argv) {
 				opts.cluster_threshold = atoi(argv[i+1]);
 				i += 2;
 				break;
+			case 't':
+				opts.threads = atoi(argv[i+1]);
+				if (opts.threads < 1)
+					opts.threads = 1;
+				i += 2;
+				break;
             case 'd':
                 switch (argv[i+1][0]) {
                     case 'M':
@@ -308,6 +559,26 @@ int main(int argc, char **argv) {
 		exit(1);
 	}
 
+	// Encoding reads its input from a pipe, decoding writes its output to one
+	if (strcmp(output_name, "-") == 0 && !extract) {
+		printf("Compressed output must be written to a file.\n");
+		exit(1);
+	}
+	if (strcmp(input_name, "-") == 0 && extract) {
+		printf("Compressed input must be read from a file.\n");
+		exit(1);
+	}
+	if (strcmp(output_name, "-") == 0 && (opts.verbose || opts.stats)) {
+		printf("Verbose output and stats cannot be printed when decoding to standard output.\n");
+		exit(1);
+	}
+
+	// The arithmetic, range and binary coders carry state across symbols that cannot be split into lanes
+	if (opts.lanes > 1 && !extract && opts.coder != QV_CODER_RANS && opts.coder != QV_CODER_TANS) {
+		printf("Interleaved lanes need --coder rans or tans.\n");
+		exit(1);
+	}
+
 	if (opts.verbose) {
 		if (extract) {
 			printf("%s will be decoded to %s.\n", input_name, output_name);
@@ -337,6 +608,7 @@ int main(int argc, char **argv) {
 			}
 
 			printf("Compression will use %d clusters, with a movement threshold of %.0f.\n", opts.clusters, opts.cluster_threshold);
+			printf("Blocks will be coded using %u threads.\n", opts.threads);
 		}
 	}
 
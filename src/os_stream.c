@@ -1,5 +1,13 @@
+#ifdef LINUX
+	#define _GNU_SOURCE
+#endif
+
 #include "qv_compressor.h"
 
+#ifdef LINUX
+	#include <fcntl.h>
+#endif
+
 /**
  * Allocates a file stream wrapper for the arithmetic encoder, with a given
  * already opened file handle
@@ -9,13 +17,43 @@ struct os_stream_t *alloc_os_stream(FILE *fp, uint8_t in) {
 
 	rtn->fp = fp;
 	rtn->buf = (uint8_t *) calloc(OS_STREAM_BUF_LEN, sizeof(uint8_t));
+	rtn->bufLen = OS_STREAM_BUF_LEN;
+	rtn->owned = 1;
 
 	if (in) {
-		fread(rtn->buf, sizeof(uint8_t), OS_STREAM_BUF_LEN, fp);
+		rtn->bufLen = (uint32_t) fread(rtn->buf, sizeof(uint8_t), OS_STREAM_BUF_LEN, fp);
 	}
-	rtn->bufPos = 0;
-	rtn->bitPos = 0;
-	rtn->written = 0;
+
+	return rtn;
+}
+
+/**
+ * Allocates an output stream that collects everything written into a growing
+ * memory buffer instead of a file, so that blocks coded independently can be
+ * written out later. The coded bytes are buf[0..bufPos) after stream_finish_byte
+ */
+struct os_stream_t *alloc_os_stream_mem() {
+	struct os_stream_t *rtn = (struct os_stream_t *) calloc(1, sizeof(struct os_stream_t));
+
+	rtn->buf = (uint8_t *) malloc(OS_STREAM_BUF_LEN);
+	rtn->bufLen = OS_STREAM_BUF_LEN;
+	rtn->owned = 1;
+
+	return rtn;
+}
+
+/**
+ * Allocates an input stream over a coded block that is already in memory, either
+ * read into a buffer or mapped from the file. Reading past the end of the block
+ * produces zero bits
+ * @param owned 1 if the stream takes ownership of buf and frees it
+ */
+struct os_stream_t *alloc_os_stream_buffer(uint8_t *buf, uint32_t len, uint8_t owned) {
+	struct os_stream_t *rtn = (struct os_stream_t *) calloc(1, sizeof(struct os_stream_t));
+
+	rtn->buf = buf;
+	rtn->bufLen = len;
+	rtn->owned = owned;
 
 	return rtn;
 }
@@ -25,96 +63,434 @@ struct os_stream_t *alloc_os_stream(FILE *fp, uint8_t in) {
  * this stream doesn't own it
  */
 void free_os_stream(struct os_stream_t *os) {
-	free(os->buf);
+	if (os->owned)
+		free(os->buf);
 	free(os);
 }
 
 /**
- * Reads a single bit from the stream
+ * Tops up the read accumulator. Away from the end of the buffer the next eight bytes
+ * are loaded at once, and as many whole bytes as fit are counted as consumed. Bits
+ * past that are loaded again (to the same place) next time. Near the end bytes are
+ * taken one at a time, pulling the next buffer from the file or padding with zeros
  */
-uint8_t stream_read_bit(struct os_stream_t *os) {
-	uint8_t rtn = os->buf[os->bufPos] >> 7;
+void stream_refill(struct os_stream_t *os) {
+	uint64_t word = 0;
+	uint32_t i, n;
 
-	os->buf[os->bufPos] = os->buf[os->bufPos] << 1;
-	os->bitPos += 1;
+	if (os->bufPos + 8 <= os->bufLen) {
+		for (i = 0; i < 8; ++i) {
+			word = (word << 8) | os->buf[os->bufPos + i];
+		}
+		os->acc |= word >> os->accBits;
+		n = (63 - os->accBits) >> 3;
+		os->bufPos += n;
+		os->accBits += 8*n;
+		return;
+	}
 
-	if (os->bitPos == 8) {
-		os->bitPos = 0;
-		os->bufPos += 1;
-		if (os->bufPos == OS_STREAM_BUF_LEN) {
-			fread(os->buf, sizeof(uint8_t), OS_STREAM_BUF_LEN, os->fp);
+	while (os->accBits <= 56) {
+		if (os->bufPos == os->bufLen && os->fp) {
+			os->bufLen = (uint32_t) fread(os->buf, sizeof(uint8_t), OS_STREAM_BUF_LEN, os->fp);
 			os->bufPos = 0;
 		}
+		if (os->bufPos < os->bufLen) {
+			os->acc |= ((uint64_t) os->buf[os->bufPos]) << (56 - os->accBits);
+			os->bufPos += 1;
+		}
+		os->accBits += 8;
 	}
+}
 
-	return rtn;
+/**
+ * Moves the oldest 32 bits of the write accumulator to the buffer, in big endian
+ * order so that the bytes come out exactly as if they were written a bit at a time
+ */
+void stream_flush_word(struct os_stream_t *os) {
+	uint32_t word;
+
+	if (os->bufPos + 4 > os->bufLen)
+		stream_write_buffer(os);
+
+	os->accBits -= 32;
+	word = (uint32_t) (os->acc >> os->accBits);
+	os->buf[os->bufPos] = (uint8_t) (word >> 24);
+	os->buf[os->bufPos+1] = (uint8_t) (word >> 16);
+	os->buf[os->bufPos+2] = (uint8_t) (word >> 8);
+	os->buf[os->bufPos+3] = (uint8_t) word;
+	os->bufPos += 4;
 }
 
 /**
- * Reads a grouping of bits to be interpreted as a single integer, regardless of length
- * Bits are implicitly written in bit endian order ONE AT A TIME elsewhere in the code,
- * so this must read that way too
+ * Pads the bits written so far with zeros to end on a byte boundary, then moves them to
+ * the buffer and writes it out. A full byte of padding is added if the bits already end
+ * on a boundary, as the decoder reads ahead into it
  */
-uint32_t stream_read_bits(struct os_stream_t *os, uint8_t len) {
-	uint32_t rtn = 0;
-	int8_t bit;
+void stream_finish_byte(struct os_stream_t *os) {
+	stream_write_bits(os, 0, 8 - (os->accBits & 7));
 
-	for (bit = len-1; bit >= 0; --bit) {
-		rtn |= stream_read_bit(os) << bit;
+	while (os->accBits > 0) {
+		if (os->bufPos == os->bufLen)
+			stream_write_buffer(os);
+		os->accBits -= 8;
+		os->buf[os->bufPos] = (uint8_t) (os->acc >> os->accBits);
+		os->bufPos += 1;
 	}
-
-	return rtn;
+	stream_write_buffer(os);
 }
 
 /**
- * Writes a single bit to the stream
+ * Writes out the whole bytes in the stream buffer. Memory streams have nowhere to
+ * write to, so they grow the buffer instead when it is full
  */
-void stream_write_bit(struct os_stream_t *os, uint8_t bit) {
-	bit = (bit & 1);
-	os->buf[os->bufPos] |= bit;
+void stream_write_buffer(struct os_stream_t *os) {
+	if (!os->fp) {
+		if (os->bufPos + 4 > os->bufLen) {
+			os->buf = (uint8_t *) realloc(os->buf, 2*os->bufLen);
+			os->bufLen *= 2;
+		}
+		os->written = os->bufPos;
+		return;
+	}
 
-	os->bitPos += 1;
+	fwrite(os->buf, sizeof(uint8_t), os->bufPos, os->fp);
+	os->written += os->bufPos;
+	os->bufPos = 0;
+}
 
-	if (os->bitPos == 8) {
-		os->bitPos = 0;
-		os->bufPos += 1;
-		if (os->bufPos == OS_STREAM_BUF_LEN) {
+/**
+ * Appends whole bytes, for coders that produce their output a piece at a time
+ */
+void stream_write_bytes(struct os_stream_t *os, const uint8_t *data, uint32_t len) {
+	uint32_t n;
+
+	while (len > 0) {
+		if (os->bufPos == os->bufLen)
 			stream_write_buffer(os);
+		n = os->bufLen - os->bufPos;
+		if (n > len)
+			n = len;
+		memcpy(os->buf + os->bufPos, data, n);
+		os->bufPos += n;
+		data += n;
+		len -= n;
+	}
+}
+
+/**
+ * Reads the next byte once the buffer is used up, pulling the next buffer from the file
+ * if there is one. Past the end of the input the bytes are zero
+ */
+uint8_t stream_read_buffer(struct os_stream_t *os) {
+	if (os->fp) {
+		os->bufLen = (uint32_t) fread(os->buf, sizeof(uint8_t), OS_STREAM_BUF_LEN, os->fp);
+		os->bufPos = 0;
+		if (os->bufLen > 0) {
+			os->bufPos = 1;
+			return os->buf[0];
 		}
 	}
+	return 0;
+}
+
+/**
+ * Carries out a single read or write for the I/O thread
+ */
+static void os_io_transfer(struct os_io_thread_t *io, struct os_io_t *item) {
+	if (io->reading) {
+		item->buf = (uint8_t *) malloc(item->len);
+		fseeko(item->fp, item->offset, SEEK_SET);
+		fread(item->buf, sizeof(uint8_t), item->len, item->fp);
+	}
 	else {
-		os->buf[os->bufPos] <<= 1;
+		fwrite(item->buf, sizeof(uint8_t), item->len, item->fp);
+		free(item->buf);
 	}
 }
 
+#if defined(LINUX) || defined(__APPLE__)
+
 /**
- * Writes a grouping of bits to be interpreted as a single integer and read back the
- * same way. Bits need to be written msb first
+ * Thread body for the stream I/O thread. A writer takes buffers from the ring until it
+ * is stopped and empty, while a reader fills the ring until its reads run out
  */
-void stream_write_bits(struct os_stream_t *os, uint32_t dw, uint8_t len) {
-	int8_t bit;
+static void *os_io_thread(void *arg) {
+	struct os_io_thread_t *io = (struct os_io_thread_t *) arg;
+	struct os_io_t item;
+
+	pthread_mutex_lock(&io->lock);
+	while (1) {
+		if (io->reading) {
+			while (io->count == io->capacity && !io->done)
+				pthread_cond_wait(&io->space, &io->lock);
+			if (io->done || io->next_read == io->read_count)
+				break;
+
+			item = io->reads[io->next_read];
+			io->next_read += 1;
+			pthread_mutex_unlock(&io->lock);
+			os_io_transfer(io, &item);
+			pthread_mutex_lock(&io->lock);
+
+			io->ring[(io->head + io->count) % io->capacity] = item;
+			io->count += 1;
+			pthread_cond_signal(&io->ready);
+		}
+		else {
+			while (io->count == 0 && !io->done)
+				pthread_cond_wait(&io->ready, &io->lock);
+			if (io->count == 0)
+				break;
 
-	for (bit = len-1; bit >= 0; --bit) {
-		stream_write_bit(os, (uint8_t)(dw >> bit));
+			item = io->ring[io->head];
+			pthread_mutex_unlock(&io->lock);
+			os_io_transfer(io, &item);
+			pthread_mutex_lock(&io->lock);
+
+			// The slot is only released once its write is done, so stop_os_io can wait for it
+			io->head = (io->head + 1) % io->capacity;
+			io->count -= 1;
+			pthread_cond_signal(&io->space);
+		}
 	}
+	pthread_mutex_unlock(&io->lock);
+
+	return NULL;
 }
 
 /**
- * Finishes the current byte in progress and writes the buffer out
+ * Sets up the shared state and starts the thread
  */
-void stream_finish_byte(struct os_stream_t *os) {
-	os->buf[os->bufPos] <<= (7 - os->bitPos);
-	os->bitPos = 0;
-	os->bufPos += 1;
-	stream_write_buffer(os);
+static struct os_io_thread_t *start_os_io(uint8_t reading, struct os_io_t *reads, uint32_t count, uint32_t capacity) {
+	struct os_io_thread_t *io = (struct os_io_thread_t *) calloc(1, sizeof(struct os_io_thread_t));
+
+	io->reading = reading;
+	io->capacity = (capacity < 1) ? 1 : capacity;
+	io->ring = (struct os_io_t *) calloc(io->capacity, sizeof(struct os_io_t));
+	io->reads = reads;
+	io->read_count = count;
+
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->ready, NULL);
+	pthread_cond_init(&io->space, NULL);
+	pthread_create(&io->thread, NULL, os_io_thread, io);
+
+	return io;
 }
 
 /**
- * Writes out the current stream buffer regardless of fill amount
+ * Queues a buffer to be written to fp after everything queued before it. The I/O
+ * thread takes ownership of buf and frees it once it is written. Waits if the ring
+ * is full
  */
-void stream_write_buffer(struct os_stream_t *os) {
-	fwrite(os->buf, sizeof(uint8_t), os->bufPos, os->fp);
-	memset(os->buf, 0, sizeof(uint8_t)*os->bufPos);
-	os->written += os->bufPos;
-	os->bufPos = 0;
+void os_io_write(struct os_io_thread_t *io, FILE *fp, uint8_t *buf, uint64_t len) {
+	struct os_io_t *item;
+
+	pthread_mutex_lock(&io->lock);
+	while (io->count == io->capacity)
+		pthread_cond_wait(&io->space, &io->lock);
+
+	item = &io->ring[(io->head + io->count) % io->capacity];
+	item->fp = fp;
+	item->buf = buf;
+	item->len = len;
+	io->count += 1;
+	pthread_cond_signal(&io->ready);
+	pthread_mutex_unlock(&io->lock);
+}
+
+/**
+ * Waits until a writer has written everything queued so far, so that the buffers are
+ * freed before the caller goes on to make more
+ */
+void os_io_wait(struct os_io_thread_t *io) {
+	pthread_mutex_lock(&io->lock);
+	while (io->count > 0)
+		pthread_cond_wait(&io->space, &io->lock);
+	pthread_mutex_unlock(&io->lock);
+}
+
+/**
+ * Takes the next buffer read ahead, in the order the reads were listed, waiting for the
+ * I/O thread if it isn't there yet. The caller owns the buffer
+ * @return The buffer, or NULL once every read has been taken
+ */
+uint8_t *os_io_read(struct os_io_thread_t *io, uint64_t *len) {
+	uint8_t *buf = NULL;
+
+	pthread_mutex_lock(&io->lock);
+	while (io->count == 0 && io->next_read < io->read_count)
+		pthread_cond_wait(&io->ready, &io->lock);
+
+	if (io->count > 0) {
+		buf = io->ring[io->head].buf;
+		*len = io->ring[io->head].len;
+		io->head = (io->head + 1) % io->capacity;
+		io->count -= 1;
+		pthread_cond_signal(&io->space);
+	}
+	pthread_mutex_unlock(&io->lock);
+
+	return buf;
+}
+
+/**
+ * Stops the I/O thread. A writer first finishes every write queued, while a reader
+ * discards whatever it read ahead that was not taken
+ */
+void stop_os_io(struct os_io_thread_t *io) {
+	pthread_mutex_lock(&io->lock);
+	io->done = 1;
+	pthread_cond_broadcast(&io->ready);
+	pthread_cond_broadcast(&io->space);
+	pthread_mutex_unlock(&io->lock);
+	pthread_join(io->thread, NULL);
+
+	while (io->reading && io->count > 0) {
+		free(io->ring[io->head].buf);
+		io->head = (io->head + 1) % io->capacity;
+		io->count -= 1;
+	}
+
+	pthread_cond_destroy(&io->space);
+	pthread_cond_destroy(&io->ready);
+	pthread_mutex_destroy(&io->lock);
+	free(io->ring);
+	free(io);
+}
+
+#else
+
+/**
+ * Without threads the I/O is done synchronously, when each buffer is queued or taken
+ */
+static struct os_io_thread_t *start_os_io(uint8_t reading, struct os_io_t *reads, uint32_t count, uint32_t capacity) {
+	struct os_io_thread_t *io = (struct os_io_thread_t *) calloc(1, sizeof(struct os_io_thread_t));
+
+	io->reading = reading;
+	io->reads = reads;
+	io->read_count = count;
+
+	return io;
+}
+
+void os_io_write(struct os_io_thread_t *io, FILE *fp, uint8_t *buf, uint64_t len) {
+	struct os_io_t item;
+
+	item.fp = fp;
+	item.buf = buf;
+	item.len = len;
+	os_io_transfer(io, &item);
+}
+
+void os_io_wait(struct os_io_thread_t *io) {
+}
+
+uint8_t *os_io_read(struct os_io_thread_t *io, uint64_t *len) {
+	struct os_io_t *item;
+
+	if (io->next_read == io->read_count)
+		return NULL;
+
+	item = &io->reads[io->next_read];
+	io->next_read += 1;
+	os_io_transfer(io, item);
+	*len = item->len;
+	return item->buf;
+}
+
+void stop_os_io(struct os_io_thread_t *io) {
+	free(io);
+}
+
+#endif
+
+/**
+ * Starts a stream I/O thread that writes buffers as they are queued with os_io_write
+ * @param capacity Buffers that may wait to be written before os_io_write blocks
+ */
+struct os_io_thread_t *start_os_writer(uint32_t capacity) {
+	return start_os_io(0, NULL, 0, capacity);
+}
+
+/**
+ * Starts a stream I/O thread that reads the listed buffers ahead, in order, for
+ * os_io_read to take. The list must stay valid until stop_os_io
+ * @param capacity Buffers that may be read ahead of the one being taken
+ */
+struct os_io_thread_t *start_os_reader(struct os_io_t *reads, uint32_t count, uint32_t capacity) {
+	return start_os_io(1, reads, count, capacity);
+}
+
+/**
+ * Opens text output to fp, which must not be written to any other way until it is
+ * closed. Output to a pipe asks for a larger pipe buffer where the system allows it,
+ * so that each large write needs fewer round trips through the reader
+ * @param capacity Buffers that may wait to be written before the caller blocks
+ */
+struct text_output_t *open_text_output(FILE *fp, uint32_t capacity) {
+	struct text_output_t *out = (struct text_output_t *) calloc(1, sizeof(struct text_output_t));
+#if defined(LINUX) && defined(F_SETPIPE_SZ)
+	struct stat finfo;
+
+	if (fstat(fileno(fp), &finfo) == 0 && S_ISFIFO(finfo.st_mode))
+		fcntl(fileno(fp), F_SETPIPE_SZ, TEXT_PIPE_SIZE);
+#endif
+
+	fflush(fp);
+	out->fp = fp;
+	out->io = start_os_writer(capacity);
+
+	return out;
+}
+
+/**
+ * Hands a whole block of text to the output after anything gathered so far. The output
+ * takes ownership of text and frees it once it is written
+ */
+void text_output_block(struct text_output_t *out, char *text, uint64_t len) {
+	if (out->pos > 0) {
+		os_io_write(out->io, out->fp, (uint8_t *) out->buf, out->pos);
+		out->buf = NULL;
+		out->pos = 0;
+	}
+	os_io_write(out->io, out->fp, (uint8_t *) text, len);
+}
+
+/**
+ * Copies a small piece of text to the output, gathering it with the pieces around it
+ */
+void text_output_append(struct text_output_t *out, const char *data, uint32_t len) {
+	uint32_t n;
+
+	while (len > 0) {
+		if (!out->buf)
+			out->buf = (char *) malloc(OS_STREAM_BUF_LEN);
+
+		n = OS_STREAM_BUF_LEN - out->pos;
+		if (n > len)
+			n = len;
+		memcpy(out->buf + out->pos, data, n);
+		out->pos += n;
+		data += n;
+		len -= n;
+
+		if (out->pos == OS_STREAM_BUF_LEN) {
+			os_io_write(out->io, out->fp, (uint8_t *) out->buf, out->pos);
+			out->buf = NULL;
+			out->pos = 0;
+		}
+	}
+}
+
+/**
+ * Writes out everything still pending and closes the output, leaving fp open
+ */
+void close_text_output(struct text_output_t *out) {
+	if (out->pos > 0)
+		os_io_write(out->io, out->fp, (uint8_t *) out->buf, out->pos);
+	else
+		free(out->buf);
+	stop_os_io(out->io);
+	free(out);
 }
@@ -206,9 +206,19 @@ struct pmf_t *combine_pmfs(struct pmf_t *a, struct pmf_t *b, double weight_a, do
 
 /**
  * When counting symbols, this handles incrementing everything for the given
- * index
+ * index. Counts are halved before the total can overflow, which keeps their proportions
  */
 void pmf_increment(struct pmf_t *pmf, uint32_t index) {
+	uint32_t i;
+
+	if (pmf->total == UINT32_MAX) {
+		pmf->total = 0;
+		for (i = 0; i < pmf->alphabet->size; ++i) {
+			pmf->counts[i] >>= 1;
+			pmf->total += pmf->counts[i];
+		}
+	}
+
 	pmf->counts[index] += 1;
 	pmf->total += 1;
 }
@@ -1,13 +1,66 @@
 #include <assert.h>
 #include "qv_compressor.h"
 
+#if defined(LINUX) || defined(__APPLE__)
+	#include <arpa/inet.h>
+	#include <sys/mman.h>
+#endif
+
+/**
+ * Codes one symbol with whichever coder the stream uses
+ */
+static inline void encode_symbol(arithStream as, stream_stats_ptr_t stats, uint32_t x) {
+	if (as->coder == QV_CODER_RANGE)
+		range_encoder_step(as->rc, stats, x, as->os);
+	else if (as->coder == QV_CODER_RANS)
+		rans_encoder_step(as->rans, stats, x, as->os);
+	else if (as->coder == QV_CODER_TANS)
+		tans_encoder_step(as->tans, stats, x, as->os);
+	else if (as->coder == QV_CODER_BINARY)
+		binary_encoder_step(as->rc, stats, x, as->os);
+	else
+		arithmetic_encoder_step(as->a, stats, x, as->os);
+}
+
+/**
+ * Adapts the stats to a symbol just coded. tANS codes each block with fixed tables, and
+ * the binary coder adapts its bins as it codes them, so their stats are left alone
+ */
+static inline void adapt_symbol(arithStream as, stream_stats_ptr_t stats, uint32_t x) {
+	if (as->coder != QV_CODER_TANS && as->coder != QV_CODER_BINARY)
+		update_stats(stats, x, as->a->r);
+}
+
+static inline uint32_t decode_symbol(arithStream as, stream_stats_ptr_t stats) {
+	if (as->coder == QV_CODER_RANGE)
+		return range_decoder_step(as->rc, stats, as->os);
+	if (as->coder == QV_CODER_RANS)
+		return rans_decoder_step(as->rans, stats, as->os);
+	if (as->coder == QV_CODER_TANS)
+		return tans_decoder_step(as->tans, stats, as->os);
+	if (as->coder == QV_CODER_BINARY)
+		return binary_decoder_step(as->rc, stats, as->os);
+	return arithmetic_decoder_step(as->a, stats, as->os);
+}
+
+/**
+ * Makes the following symbols use the given lane's coder state. Only rANS and tANS
+ * have lanes
+ */
+static inline void select_lane(arithStream as, uint32_t lane) {
+	if (as->coder == QV_CODER_RANS)
+		as->rans->lane = lane;
+	else if (as->coder == QV_CODER_TANS)
+		as->tans->lane = lane;
+}
+
 /**
  * Compress a quality value and send it into the arithmetic encoder output stream,
  * with appropriate context information
  */
 void compress_qv(arithStream as, uint32_t x, uint8_t cluster, uint32_t column, uint32_t idx) {
-    arithmetic_encoder_step(as->a, as->stats[cluster][column][idx], x, as->os);
-    update_stats(as->stats[cluster][column][idx], x, as->a->r);
+    encode_symbol(as, as->stats[cluster][column][idx], x);
+    adapt_symbol(as, as->stats[cluster][column][idx], x);
 }
 
 /**
@@ -17,8 +70,32 @@ void compress_qv(arithStream as, uint32_t x, uint8_t cluster, uint32_t column, u
  * @todo Determine which has a lower bitrate (probably almost the same)
  */
 void qv_write_cluster(arithStream as, uint8_t cluster) {
-	arithmetic_encoder_step(as->a, as->cluster_stats, cluster, as->os);
-	update_stats(as->cluster_stats, cluster, as->a->r);
+	encode_symbol(as, as->cluster_stats, cluster);
+	adapt_symbol(as, as->cluster_stats, cluster);
+}
+
+/**
+ * Writes the length of a line ahead of its quality values, adapting to the lengths
+ * seen in the same cluster. Long read lengths are written as their number of bits,
+ * followed by the bits below the leading one
+ */
+void qv_write_length(arithStream as, uint8_t cluster, uint32_t length) {
+	uint32_t bits = 0;
+
+	if (!as->length_classes) {
+		encode_symbol(as, as->length_stats[cluster], length);
+		adapt_symbol(as, as->length_stats[cluster], length);
+		return;
+	}
+
+	while (bits < 32 && (length >> bits) > 0)
+		bits += 1;
+	encode_symbol(as, as->length_stats[cluster], bits);
+	adapt_symbol(as, as->length_stats[cluster], bits);
+
+	for (; bits > 1; --bits) {
+		encode_symbol(as, as->bit_stats, (length >> (bits-2)) & 1);
+	}
 }
 
 /**
@@ -27,8 +104,8 @@ void qv_write_cluster(arithStream as, uint8_t cluster) {
 uint32_t decompress_qv(arithStream as, uint8_t cluster, uint32_t column, uint32_t idx) {
     uint32_t x;
     
-    x = arithmetic_decoder_step(as->a, as->stats[cluster][column][idx], as->os);
-    update_stats(as->stats[cluster][column][idx], x, as->a->r);
+    x = decode_symbol(as, as->stats[cluster][column][idx]);
+    adapt_symbol(as, as->stats[cluster][column][idx], x);
     
     return x;
 }
@@ -36,196 +113,845 @@ uint32_t decompress_qv(arithStream as, uint8_t cluster, uint32_t column, uint32_
 uint8_t qv_read_cluster(arithStream as) {
 	uint32_t x;
 	
-	x = arithmetic_decoder_step(as->a, as->cluster_stats, as->os);
-	update_stats(as->cluster_stats, x, as->a->r);
+	x = decode_symbol(as, as->cluster_stats);
+	adapt_symbol(as, as->cluster_stats, x);
 
 	return (uint8_t) x;
 }
 
+uint32_t qv_read_length(arithStream as, uint8_t cluster) {
+	uint32_t x, length;
+
+	x = decode_symbol(as, as->length_stats[cluster]);
+	adapt_symbol(as, as->length_stats[cluster], x);
+	if (!as->length_classes || x == 0)
+		return x;
+
+	for (length = 1; x > 1; --x) {
+		length = (length << 1) | decode_symbol(as, as->bit_stats);
+	}
+	return length;
+}
+
 /**
- * Compress a sequence of quality scores including dealing with organization by cluster
+ * Writes a 64 bit integer in network (big endian) order
  */
-uint32_t start_qv_compression(struct quality_file_t *info, FILE *fout, double *dis, FILE * funcompressed) {
-    unsigned int osSize = 0;
-    
-    qv_compressor qvc;
-    
+static void write_uint64(FILE *fp, uint64_t v) {
+	uint8_t buf[8];
+	int i;
+
+	for (i = 0; i < 8; ++i) {
+		buf[i] = (uint8_t) (v >> (56 - 8*i));
+	}
+	fwrite(buf, sizeof(uint8_t), 8, fp);
+}
+
+/**
+ * Writes a 32 bit integer in network order
+ */
+static void write_uint32(FILE *fp, uint32_t v) {
+	v = htonl(v);
+	fwrite(&v, sizeof(uint32_t), 1, fp);
+}
+
+/**
+ * Reads a 32 bit integer stored in network order
+ */
+static uint32_t read_uint32(FILE *fp) {
+	uint32_t v = 0;
+
+	fread(&v, sizeof(uint32_t), 1, fp);
+	return ntohl(v);
+}
+
+/**
+ * Reads a 64 bit integer stored in network (big endian) order
+ */
+static uint64_t read_uint64(FILE *fp) {
+	uint8_t buf[8];
+	uint64_t v = 0;
+	int i;
+
+	fread(buf, sizeof(uint8_t), 8, fp);
+	for (i = 0; i < 8; ++i) {
+		v = (v << 8) | buf[i];
+	}
+	return v;
+}
+
+/**
+ * Quantizes and compresses a single line, optionally storing the quantized text. The
+ * line's length is coded first, and only that many columns follow
+ * @param uncompressed If not NULL, receives the quantized values as text (length+1 bytes with the newline)
+ * @return The total distortion of the line
+ */
+static double compress_line(arithStream as, struct quality_file_t *info, struct well_state_t *well, struct line_t *line, char *uncompressed) {
 	uint32_t s = 0, idx = 0, q_state = 0;
-	double distortion = 0.0;
 	double error = 0.0;
     uint8_t qv = 0, prev_qv = 0;
-    uint32_t columns = info->columns;
+    uint32_t columns = line->length;
     struct quantizer_t *q;
 	struct cond_quantizer_list_t *qlist;
-
-	uint32_t block_idx, line_idx;
 	uint8_t cluster_id;
-
-	struct line_t *line;
 	symbol_t data;
-        
-    
-    // Initialize the compressor
-    qvc = initialize_qv_compressor(fout, COMPRESSION, info);
-    
-    // Start compressing the file
-	distortion = 0.0;
-	block_idx = 0;
-	line_idx = 0;
 
-	do {
-		line = &info->blocks[block_idx].lines[line_idx];
-		
-        if (info->opts->verbose && line_idx == 0) {
-            printf("Line: %dM\n", block_idx);
-        }
-
-		// Write clustering information and pull the correct codebook
-		cluster_id = line->cluster;
-		qlist = info->clusters->clusters[cluster_id].qlist;
-		qv_write_cluster(qvc->Quals, cluster_id);
-        
-		// Select first column's codebook with no left context
-		q = choose_quantizer(qlist, &info->well, 0, 0, &idx);
-        
-		// Quantize, compress and calculate error simultaneously
-		data = line->m_data[0] - 33;
+	// Write clustering information and pull the correct codebook
+	cluster_id = line->cluster;
+	qlist = info->clusters->clusters[cluster_id].qlist;
+	qv_write_cluster(as, cluster_id);
+	qv_write_length(as, cluster_id, columns);
+	
+	for (s = 0; s < columns; ++s) {
+		// The first column's codebook has no left context
+		q = choose_quantizer(qlist, well, MODEL_COLUMN(s), prev_qv, &idx);
+		data = line->m_data[s] - 33;
 		qv = q->q[data];
-        
-        q_state = get_symbol_index(q->output_alphabet, qv);
-        compress_qv(qvc->Quals, q_state, cluster_id, 0, idx);
-		error = get_distortion(info->dist, data, qv);
-        
-        // @todo use buffer to speed up the writing
-        if (funcompressed != NULL) {
-            fputc(qv+33, funcompressed);
-        }
-        
-        prev_qv = qv;
-        
-		for (s = 1; s < columns; ++s) {
-			q = choose_quantizer(qlist, &info->well, s, prev_qv, &idx);
-			data = line->m_data[s] - 33;
+		q_state = get_symbol_index(q->output_alphabet, qv);
+		
+		if (uncompressed != NULL) {
+			uncompressed[s] = qv+33;
+		}
+		
+		compress_qv(as, q_state, cluster_id, MODEL_COLUMN(s), idx);
+		error += get_distortion(info->dist, data, qv);
+		prev_qv = qv;
+	}
+	
+	if (uncompressed != NULL) {
+		uncompressed[columns] = '\n';
+	}
+	
+	return error;
+}
+
+/**
+ * Quantizes and compresses a group of up to QV_MAX_LANES consecutive lines, each with
+ * its own coder lane. The clusters and lengths come first, in line order, and then the
+ * lines' quality values a column at a time, so that the lanes take turns and the
+ * decoder can work on one lane while another waits on its state
+ * @param uncompressed If not NULL, receives the quantized lines as compress_line writes them, one after another
+ * @return The total distortion of the lines
+ */
+static double compress_lines(arithStream as, struct quality_file_t *info, struct well_state_t *well, struct line_t *lines, uint32_t count, char *uncompressed) {
+	struct cond_quantizer_list_t *qlist[QV_MAX_LANES];
+	uint8_t prev_qv[QV_MAX_LANES];
+	char *text[QV_MAX_LANES];
+	uint32_t s, l, idx = 0, q_state = 0, columns = 0;
+	double error = 0.0;
+	uint8_t qv = 0;
+	struct quantizer_t *q;
+	symbol_t data;
+
+	for (l = 0; l < count; ++l) {
+		select_lane(as, l);
+		qlist[l] = info->clusters->clusters[lines[l].cluster].qlist;
+		qv_write_cluster(as, lines[l].cluster);
+		qv_write_length(as, lines[l].cluster, lines[l].length);
+		prev_qv[l] = 0;
+
+		text[l] = uncompressed;
+		if (uncompressed != NULL) {
+			uncompressed[lines[l].length] = '\n';
+			uncompressed += lines[l].length+1;
+		}
+		if (lines[l].length > columns)
+			columns = lines[l].length;
+	}
+
+	for (s = 0; s < columns; ++s) {
+		for (l = 0; l < count; ++l) {
+			if (s >= lines[l].length)
+				continue;
+
+			select_lane(as, l);
+			q = choose_quantizer(qlist[l], well, MODEL_COLUMN(s), prev_qv[l], &idx);
+			data = lines[l].m_data[s] - 33;
 			qv = q->q[data];
-            q_state = get_symbol_index(q->output_alphabet, qv);
-            
-            // @todo use buffer to speed up the writing
-            if (funcompressed != NULL) {
-                fputc(qv+33, funcompressed);
-            }
-            
-            compress_qv(qvc->Quals, q_state, cluster_id, s, idx);
+			q_state = get_symbol_index(q->output_alphabet, qv);
+
+			if (text[l] != NULL) {
+				text[l][s] = qv+33;
+			}
+
+			compress_qv(as, q_state, lines[l].cluster, MODEL_COLUMN(s), idx);
 			error += get_distortion(info->dist, data, qv);
-            prev_qv = qv;
-		}
-        
-       	// @todo use buffer to speed up the writing
-        if (funcompressed != NULL) {
-            fputc('\n', funcompressed);
-        }
-        
-        distortion += error / ((double) columns);
-
-		// Set up next set of pointers
-		line_idx += 1;
-		if (line_idx == info->blocks[block_idx].count) {
-			line_idx = 0;
-			block_idx += 1;
-		}
-	} while (block_idx < info->block_count);
-    
-    osSize = encoder_last_step(qvc->Quals->a, qvc->Quals->os);
-    
+			prev_qv[l] = qv;
+		}
+	}
+
+	return error;
+}
+
+/**
+ * Codes the lines of a block in order, or a group of info->lanes lines at a time when
+ * the coder is interleaved
+ * @param uncompressed If not NULL, receives the block's quantized lines, each followed by its newline
+ * @return The total distortion of the lines
+ */
+static double compress_block_lines(arithStream as, struct quality_file_t *info, struct well_state_t *well, struct line_block_t *block, char *uncompressed) {
+	uint32_t line_idx, count, l;
+	double error = 0.0;
+
+	for (line_idx = 0; line_idx < block->count; line_idx += count) {
+		count = 1;
+		if (info->lanes > 1) {
+			count = block->count - line_idx;
+			if (count > info->lanes)
+				count = info->lanes;
+			error += compress_lines(as, info, well, &block->lines[line_idx], count, uncompressed);
+		}
+		else {
+			error += compress_line(as, info, well, &block->lines[line_idx], uncompressed);
+		}
+
+		for (l = 0; uncompressed && l < count; ++l) {
+			uncompressed += block->lines[line_idx + l].length+1;
+		}
+	}
+	return error;
+}
+
+/**
+ * Codes one line block into its own memory stream, with its own stats and WELL state.
+ * Run as a parallel job over a batch of blocks
+ */
+static void compress_block(void *ctx, uint32_t job) {
+	struct qv_block_batch_t *batch = (struct qv_block_batch_t *) ctx;
+	struct qv_block_t *blk = &batch->blocks[job];
+	struct quality_file_t *info = batch->info;
+	struct line_block_t *block = &info->blocks[blk->id - batch->first_block];
+	uint32_t line_idx;
+	char *uncompressed = NULL;
+
+	if (info->opts->verbose) {
+		printf("Line: %dM\n", blk->id);
+	}
+
+	well_1024a_fork(&blk->well, &info->well, blk->id);
+	blk->qvc = initialize_qv_compressor(alloc_os_stream_mem(), COMPRESSION, info);
+	blk->distortion = 0.0;
+	blk->symbols = 0;
+
+	// tANS first counts the block's symbols for its tables, and then codes the block again
+	// with the same quantizer choices
+	if (blk->qvc->Quals->coder == QV_CODER_TANS) {
+		tans_begin_count(blk->qvc->Quals, info);
+		compress_block_lines(blk->qvc->Quals, info, &blk->well, block, NULL);
+		tans_write_tables(blk->qvc->Quals, info);
+		well_1024a_fork(&blk->well, &info->well, blk->id);
+	}
+
+	for (line_idx = 0; line_idx < block->count; ++line_idx) {
+		blk->symbols += block->lines[line_idx].length;
+	}
+
+	// Lines are packed, each followed by its newline
+	if (batch->uncompressed) {
+		blk->text_size = blk->symbols + block->count;
+		blk->text = (char *) malloc(blk->text_size);
+		blk->text_len = blk->text_size;
+		uncompressed = blk->text;
+	}
+
+	blk->distortion = compress_block_lines(blk->qvc->Quals, info, &blk->well, block, uncompressed);
+
+	if (blk->qvc->Quals->coder == QV_CODER_RANGE || blk->qvc->Quals->coder == QV_CODER_BINARY)
+		range_encoder_last_step(blk->qvc->Quals->rc, blk->qvc->Quals->os);
+	else if (blk->qvc->Quals->coder == QV_CODER_RANS)
+		rans_encoder_last_step(blk->qvc->Quals->rans, blk->qvc->Quals->os);
+	else if (blk->qvc->Quals->coder == QV_CODER_TANS)
+		tans_encoder_last_step(blk->qvc->Quals->tans, blk->qvc->Quals->os);
+	else
+		encoder_last_step(blk->qvc->Quals->a, blk->qvc->Quals->os);
+}
+
+/**
+ * Starts a block stream: writes the WELL seed that every block's quantizer choices are
+ * forked from, and sets up an empty block index
+ */
+void begin_qv_compression(struct qv_encoder_t *enc, struct quality_file_t *info, FILE *fout, FILE *funcompressed) {
+	uint32_t threads = info->opts->threads;
+
+	if (threads < 1)
+		threads = 1;
+
+	initialize_well_seed(fout, COMPRESSION, info);
+
+	enc->fout = fout;
+	enc->uncompressed = (funcompressed) ? open_text_output(funcompressed, 2*threads) : NULL;
+	enc->io = start_os_writer(2*threads);
+	enc->index.count = 0;
+	enc->index.data_start = 0;
+	enc->index_size = 64;
+	enc->index.blocks = (struct qv_block_entry_t *) calloc(enc->index_size, sizeof(struct qv_block_entry_t));
+	enc->batch.info = info;
+	enc->batch.blocks = (struct qv_block_t *) calloc(threads, sizeof(struct qv_block_t));
+	enc->batch.first_block = 0;
+	enc->batch.uncompressed = (funcompressed != NULL);
+	enc->first_line = 0;
+	enc->bytes_used = 0;
+	enc->symbols = 0;
+	enc->distortion = 0.0;
+}
+
+/**
+ * Codes all of the line blocks in info and appends them to the block stream. Every line
+ * block is coded independently, so up to opts->threads blocks are coded at the same
+ * time. info may hold the whole input or just the next window of it, in which case it
+ * must share the clusters and WELL seed of the info given to begin_qv_compression
+ */
+void compress_qv_blocks(struct qv_encoder_t *enc, struct quality_file_t *info) {
+	struct qv_block_batch_t *batch = &enc->batch;
+	struct qv_block_entry_t *entry;
+	struct qv_block_t *blk;
+	uint32_t threads = info->opts->threads;
+	uint32_t first, count, i;
+	osStream os;
+
+	if (threads < 1)
+		threads = 1;
+
+	while (enc->index.count + info->block_count > enc->index_size) {
+		enc->index_size *= 2;
+		enc->index.blocks = (struct qv_block_entry_t *) realloc(enc->index.blocks, enc->index_size*sizeof(struct qv_block_entry_t));
+	}
+
+	batch->info = info;
+	batch->first_block = enc->index.count;
+
+	// Code the blocks a batch at a time and write them out in order
+	for (first = 0; first < info->block_count; first += count) {
+		count = info->block_count - first;
+		if (count > threads)
+			count = threads;
+
+		for (i = 0; i < count; ++i) {
+			batch->blocks[i].id = batch->first_block + first + i;
+		}
+		run_parallel(compress_block, batch, count, threads);
+
+		for (i = 0; i < count; ++i) {
+			blk = &batch->blocks[i];
+			os = blk->qvc->Quals->os;
+
+			entry = &enc->index.blocks[blk->id];
+			entry->first_line = enc->first_line;
+			entry->lines = info->blocks[first + i].count;
+			entry->offset = enc->bytes_used;
+			entry->length = os->bufPos;
+			enc->first_line += entry->lines;
+
+			// The I/O thread writes the block while the next batch is coded
+			os_io_write(enc->io, enc->fout, os->buf, os->bufPos);
+			os->buf = NULL;
+			enc->bytes_used += entry->length;
+
+			if (blk->text) {
+				text_output_block(enc->uncompressed, blk->text, blk->text_len);
+				blk->text = NULL;
+			}
+
+			enc->distortion += blk->distortion;
+			enc->symbols += blk->symbols;
+			free_qv_compressor(blk->qvc, info);
+		}
+	}
+
+	enc->index.count += info->block_count;
+
+	// Under a memory limit a window's coded blocks and text are written out before the
+	// next window is read, so they never pile up on top of it
+	if (info->opts->mem_limit) {
+		os_io_wait(enc->io);
+		if (enc->uncompressed)
+			os_io_wait(enc->uncompressed->io);
+	}
+}
+
+/**
+ * Ends the block stream with the block index and trailer (see write_block_index)
+ * @return Number of bytes written for the coded blocks and the index
+ */
+uint64_t finish_qv_compression(struct qv_encoder_t *enc, double *dis) {
+	stop_os_io(enc->io);
+	if (enc->uncompressed)
+		close_text_output(enc->uncompressed);
+	write_block_index(enc->fout, &enc->index);
+	enc->bytes_used += enc->index.count*QV_INDEX_ENTRY_SIZE + QV_TRAILER_SIZE;
+
+	free(enc->batch.blocks);
+	free_block_index(&enc->index);
+
+	// Average distortion per quality value
 	if (dis)
-    	*dis = distortion / ((double) info->lines);
-    
-    return osSize;
+		*dis = (enc->symbols > 0) ? enc->distortion / ((double) enc->symbols) : 0.0;
+
+	return enc->bytes_used;
 }
 
-void start_qv_decompression(FILE *fout, FILE *fin, struct quality_file_t *info) {
-    qv_compressor qvc;
-    
-	uint32_t s = 0, idx = 0, lineCtr = 0, q_state = 0;
+/**
+ * Compress a sequence of quality scores including dealing with organization by cluster.
+ * Every line block is coded independently, so up to opts->threads blocks are coded at
+ * the same time. The output is the WELL seed followed by the coded blocks, and then the
+ * block index and trailer (see write_block_index)
+ * @return Number of bytes written for the coded blocks and the index
+ */
+uint64_t start_qv_compression(struct quality_file_t *info, FILE *fout, double *dis, FILE * funcompressed) {
+	struct qv_encoder_t enc;
+
+	begin_qv_compression(&enc, info, fout, funcompressed);
+	compress_qv_blocks(&enc, info);
+	return finish_qv_compression(&enc, dis);
+}
+
+/**
+ * Decodes a single line and appends it, with its newline, to the block's text, which
+ * grows as needed
+ */
+static void decompress_line(arithStream as, struct quality_file_t *info, struct well_state_t *well, struct qv_block_t *blk) {
+	uint32_t s = 0, idx = 0, q_state = 0;
     uint8_t prev_qv = 0, cluster_id;
-    
-    uint32_t columns = info->columns;
-	uint32_t lines = info->lines;
+    uint32_t columns;
 	struct cond_quantizer_list_t *qlist;
     struct quantizer_t *q;
+	char *line;
 
-	char *line = (char *) _alloca(columns+2);
-    line[columns] = '\n';
-	line[columns+1] = '\0';
-    
-    // Initialize the compressor
-    qvc = initialize_qv_compressor(fin, DECOMPRESSION, info);
-    
-	// Last line has to be handled separately to clear the arithmetic decoder
-	while (lineCtr < lines - 1) {
-        if (info->opts->verbose && lineCtr%1000000 == 0){
-            printf("Line: %dM\n", lineCtr/1000000);
-        }
-        lineCtr++;
-
-		cluster_id = qv_read_cluster(qvc->Quals);
-		assert(cluster_id < info->cluster_count);
-		qlist = info->clusters->clusters[cluster_id].qlist;
-        
-		// Select first column's codebook with no left context
-		q = choose_quantizer(qlist, &info->well, 0, 0, &idx);
-        
-		// Quantize, compress and calculate error simultaneously
-		// Note that in this version the quantizer outputs are 0-72, so the +33 offset is different from before
-        q_state = decompress_qv(qvc->Quals, cluster_id, 0, idx);
-        line[0] = q->output_alphabet->symbols[q_state] + 33;
-        prev_qv = line[0] - 33;
-        
-		for (s = 1; s < columns; ++s) {
-			// Quantize and compute error for MSE
-			q = choose_quantizer(qlist, &info->well, s, prev_qv, &idx);
-            q_state = decompress_qv(qvc->Quals, cluster_id, s, idx);
-            line[s] = q->output_alphabet->symbols[q_state] + 33;
-            prev_qv = line[s] - 33;
-		}
-        
-        // Write this line to the output file, note '\n' at the end of the line buffer to get the right length
-		fwrite(line, columns+1, sizeof(uint8_t), fout);
-	}
-    
-    // Last Line
-    if (info->opts->verbose && lineCtr%1000000 == 0){
-        printf("Line: %dM\n", lineCtr/1000000);
-    }
-    lineCtr++;
-    
-	cluster_id = qv_read_cluster(qvc->Quals);
-		assert(cluster_id < info->cluster_count);
+	cluster_id = qv_read_cluster(as);
+	assert(cluster_id < info->cluster_count);
 	qlist = info->clusters->clusters[cluster_id].qlist;
+	columns = qv_read_length(as, cluster_id);
 
-    // Select first column's codebook with no left context
-    q = choose_quantizer(qlist, &info->well, 0, 0, &idx);
-    
-    // Quantize, compress and calculate error simultaneously
-    // Note that in this version the quantizer outputs are 0-72, so the +33 offset is different from before
-    q_state = decompress_qv(qvc->Quals, cluster_id, 0, idx);
-    line[0] = q->output_alphabet->symbols[q_state] + 33;
-    prev_qv = line[0] - 33;
-    
-    for (s = 1; s < columns - 1; ++s) {
-        // Quantize and compute error for MSE
-        q = choose_quantizer(qlist, &info->well, s, prev_qv, &idx);
-        q_state = decompress_qv(qvc->Quals, cluster_id, s, idx);
-        line[s] = q->output_alphabet->symbols[q_state] + 33;
-        prev_qv = line[s] - 33;
-    }
-    
-    // Last column
-    q = choose_quantizer(qlist, &info->well, s, prev_qv, &idx);
-    q_state = decoder_last_step(qvc->Quals->a, qvc->Quals->stats[cluster_id][s][idx]);
-    line[s] = q->output_alphabet->symbols[q_state] + 33;
-    
-    // Write this line to the output file, note '\n' at the end of the line buffer to get the right length
-    fwrite(line, columns+1, sizeof(uint8_t), fout);
+	while (blk->text_len + columns + 1 > blk->text_size) {
+		blk->text_size *= 2;
+		blk->text = (char *) realloc(blk->text, blk->text_size);
+	}
+	line = blk->text + blk->text_len;
+	
+	// Note that in this version the quantizer outputs are 0-72, so the +33 offset is different from before
+	for (s = 0; s < columns; ++s) {
+		// The first column's codebook has no left context
+		q = choose_quantizer(qlist, well, MODEL_COLUMN(s), prev_qv, &idx);
+		q_state = decompress_qv(as, cluster_id, MODEL_COLUMN(s), idx);
+		line[s] = q->output_alphabet->symbols[q_state] + 33;
+		prev_qv = line[s] - 33;
+	}
+	line[columns] = '\n';
+	blk->text_len += columns + 1;
+}
+
+/**
+ * Decodes a group of lines coded by compress_lines and appends them to the block's
+ * text, one after another with their newlines
+ */
+static void decompress_lines(arithStream as, struct quality_file_t *info, struct well_state_t *well, struct qv_block_t *blk, uint32_t count) {
+	struct cond_quantizer_list_t *qlist[QV_MAX_LANES];
+	uint8_t prev_qv[QV_MAX_LANES], cluster_id[QV_MAX_LANES];
+	uint32_t length[QV_MAX_LANES];
+	char *line[QV_MAX_LANES];
+	uint32_t s, l, idx = 0, q_state = 0, columns = 0;
+	uint64_t total = 0;
+	struct quantizer_t *q;
+
+	for (l = 0; l < count; ++l) {
+		select_lane(as, l);
+		cluster_id[l] = qv_read_cluster(as);
+		assert(cluster_id[l] < info->cluster_count);
+		qlist[l] = info->clusters->clusters[cluster_id[l]].qlist;
+		length[l] = qv_read_length(as, cluster_id[l]);
+		prev_qv[l] = 0;
+
+		total += length[l] + 1;
+		if (length[l] > columns)
+			columns = length[l];
+	}
+
+	while (blk->text_len + total > blk->text_size) {
+		blk->text_size *= 2;
+		blk->text = (char *) realloc(blk->text, blk->text_size);
+	}
+	for (l = 0; l < count; ++l) {
+		line[l] = blk->text + blk->text_len;
+		line[l][length[l]] = '\n';
+		blk->text_len += length[l] + 1;
+	}
+
+	for (s = 0; s < columns; ++s) {
+		for (l = 0; l < count; ++l) {
+			if (s >= length[l])
+				continue;
+
+			select_lane(as, l);
+			q = choose_quantizer(qlist[l], well, MODEL_COLUMN(s), prev_qv[l], &idx);
+			q_state = decompress_qv(as, cluster_id[l], MODEL_COLUMN(s), idx);
+			line[l][s] = q->output_alphabet->symbols[q_state] + 33;
+			prev_qv[l] = line[l][s] - 33;
+		}
+	}
+}
+
+/**
+ * Decodes one block from its coded bytes into text lines, with its own decoder, stats
+ * and WELL state. Lines before blk->skip are decoded but not kept, and neither are lines
+ * from blk->count on that share a lane group with a wanted line. The lines that are kept
+ * are packed one after another with their newlines. Run as a parallel job over a batch
+ * of blocks
+ */
+static void decompress_block(void *ctx, uint32_t job) {
+	struct qv_block_batch_t *batch = (struct qv_block_batch_t *) ctx;
+	struct qv_block_t *blk = &batch->blocks[job];
+	struct quality_file_t *info = batch->info;
+	uint32_t line_idx, count;
+	uint64_t start;
+	char *kept;
+
+	if (info->opts->verbose) {
+		printf("Line: %dM\n", blk->id);
+	}
+
+	// The decoder takes ownership of the coded bytes, unless they are mapped
+	well_1024a_fork(&blk->well, &info->well, blk->id);
+	blk->qvc = initialize_qv_compressor(alloc_os_stream_buffer(blk->coded, (uint32_t) blk->coded_len, !blk->coded_mapped), DECOMPRESSION, info);
+	blk->coded = NULL;
+
+	// Start with room for the lines at the longest short read length
+	blk->text_size = ((uint64_t) (blk->count - blk->skip)) * (MODEL_COLUMNS(info)+1);
+	blk->text = (char *) malloc(blk->text_size);
+	blk->text_len = 0;
+	for (line_idx = 0; line_idx < blk->count; line_idx += count) {
+		start = blk->text_len;
+		count = 1;
+		if (info->lanes > 1) {
+			// The encoder groups the lanes over all the block's lines, so the last group
+			// wanted is decoded whole even when the range ends inside it
+			count = blk->coded_lines - line_idx;
+			if (count > info->lanes)
+				count = info->lanes;
+			decompress_lines(blk->qvc->Quals, info, &blk->well, blk, count);
+		}
+		else {
+			decompress_line(blk->qvc->Quals, info, &blk->well, blk);
+		}
+
+		// Nothing is kept before blk->skip, so a group that reaches past it starts the text
+		if (line_idx + count <= blk->skip) {
+			blk->text_len = 0;
+		}
+		else if (line_idx < blk->skip) {
+			kept = blk->text;
+			for (; line_idx < blk->skip; ++line_idx, --count) {
+				kept = (char *) memchr(kept, '\n', blk->text_len - (kept - blk->text)) + 1;
+			}
+			blk->text_len -= kept - blk->text;
+			memmove(blk->text, kept, blk->text_len);
+			start = 0;
+		}
+
+		// Nor is anything from blk->count on
+		if (line_idx + count > blk->count) {
+			kept = blk->text + start;
+			for (; line_idx < blk->count; ++line_idx, --count) {
+				kept = (char *) memchr(kept, '\n', blk->text_len - (kept - blk->text)) + 1;
+			}
+			blk->text_len = kept - blk->text;
+		}
+	}
+
+	free_qv_compressor(blk->qvc, info);
+	blk->qvc = NULL;
+}
+
+/**
+ * Writes the block index at the end of the file. Each entry is the first line (8 bytes),
+ * line count (4), offset from the start of the block data (8) and coded length (8) of a
+ * block. The trailer that follows holds the number of entries (4) and a magic tag (4),
+ * so a reader can find the index by seeking relative to the end of the file
+ */
+void write_block_index(FILE *fout, struct qv_block_index_t *index) {
+	uint32_t i;
+
+	for (i = 0; i < index->count; ++i) {
+		write_uint64(fout, index->blocks[i].first_line);
+		write_uint32(fout, index->blocks[i].lines);
+		write_uint64(fout, index->blocks[i].offset);
+		write_uint64(fout, index->blocks[i].length);
+	}
+
+	write_uint32(fout, index->count);
+	fwrite(QV_TRAILER_MAGIC, sizeof(char), 4, fout);
+}
+
+/**
+ * Reads the block index from the end of the file. The file must be positioned at the
+ * start of the block data, and is left there afterwards
+ * @return 1 on success, 0 if the trailer is missing or damaged
+ */
+uint32_t read_block_index(FILE *fin, struct qv_block_index_t *index) {
+	char magic[4];
+	uint32_t i;
+
+	index->data_start = ftello(fin);
+	index->count = 0;
+	index->blocks = NULL;
+
+	if (fseeko(fin, -QV_TRAILER_SIZE, SEEK_END) != 0)
+		return 0;
+	index->count = read_uint32(fin);
+	if (fread(magic, sizeof(char), 4, fin) != 4 || memcmp(magic, QV_TRAILER_MAGIC, 4) != 0)
+		return 0;
+
+	if (fseeko(fin, -(QV_TRAILER_SIZE + ((int64_t) index->count)*QV_INDEX_ENTRY_SIZE), SEEK_END) != 0)
+		return 0;
+	index->blocks = (struct qv_block_entry_t *) calloc(index->count, sizeof(struct qv_block_entry_t));
+	for (i = 0; i < index->count; ++i) {
+		index->blocks[i].first_line = read_uint64(fin);
+		index->blocks[i].lines = read_uint32(fin);
+		index->blocks[i].offset = read_uint64(fin);
+		index->blocks[i].length = read_uint64(fin);
+	}
+
+	fseeko(fin, index->data_start, SEEK_SET);
+	return 1;
+}
+
+void free_block_index(struct qv_block_index_t *index) {
+	free(index->blocks);
+}
+
+/**
+ * Reads one line of a sidecar file into a growable buffer, keeping the newline
+ * @return Length of the line, or 0 at the end of the file
+ */
+static uint32_t read_sidecar_line(FILE *fp, char **buf, uint32_t *size) {
+	uint32_t len = 0;
+
+	while (fgets(*buf + len, *size - len, fp)) {
+		len += strlen(*buf + len);
+		if ((*buf)[len-1] == '\n')
+			return len;
+
+		// Line didn't fit, make room for the rest of it
+		*size *= 2;
+		*buf = (char *) realloc(*buf, *size);
+	}
+
+	// Last line of the file may be missing its newline
+	if (len > 0) {
+		(*buf)[len] = '\n';
+		len += 1;
+	}
+	return len;
+}
+
+/**
+ * Writes decoded quality lines as full FASTQ records, taking the header and sequence
+ * line for each record from the sidecar files
+ */
+static void write_fastq_records(struct fastq_output_t *out, const char *text, uint32_t count) {
+	uint32_t i, len;
+	const char *eol;
+
+	for (i = 0; i < count; ++i) {
+		len = read_sidecar_line(out->headers, &out->line, &out->line_size);
+		if (len == 0) {
+			printf("Header file ended before the quality values.\n");
+			exit(1);
+		}
+		text_output_append(out->out, out->line, len);
+
+		len = read_sidecar_line(out->sequences, &out->line, &out->line_size);
+		if (len == 0) {
+			printf("Sequence file ended before the quality values.\n");
+			exit(1);
+		}
+		text_output_append(out->out, out->line, len);
+
+		text_output_append(out->out, "+\n", 2);
+		eol = (const char *) memchr(text, '\n', MAX_READS_PER_LINE+1);
+		text_output_append(out->out, text, (uint32_t) (eol - text + 1));
+		text = eol + 1;
+	}
+}
+
+/**
+ * Maps a compressed file for reading the coded blocks in place
+ * @return The mapping, or NULL if the file can't be mapped
+ */
+static uint8_t *map_archive(FILE *fin, uint64_t *size) {
+#if defined(LINUX) || defined(__APPLE__)
+	struct _stat finfo;
+	void *map;
+
+	if (fstat(fileno(fin), &finfo) != 0 || finfo.st_size == 0)
+		return NULL;
+	map = mmap(NULL, finfo.st_size, PROT_READ, MAP_SHARED, fileno(fin), 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	madvise(map, finfo.st_size, MADV_SEQUENTIAL);
+	*size = finfo.st_size;
+	return (uint8_t *) map;
+#else
+	return NULL;
+#endif
+}
+
+static void unmap_archive(uint8_t *map, uint64_t size) {
+#if defined(LINUX) || defined(__APPLE__)
+	munmap(map, size);
+#endif
+}
+
+/**
+ * Asks for the coded bytes of blocks [first, last) to be read in ahead of the decoder,
+ * stopping at end
+ */
+static void prefetch_blocks(uint8_t *map, struct qv_block_index_t *index, uint32_t first, uint32_t last, uint32_t end) {
+#if defined(LINUX) || defined(__APPLE__)
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t start, stop;
+
+	if (last > end)
+		last = end;
+	if (first >= last)
+		return;
+
+	start = (index->data_start + index->blocks[first].offset) / page * page;
+	stop = index->data_start + index->blocks[last-1].offset + index->blocks[last-1].length;
+	madvise(map + start, stop - start, MADV_WILLNEED);
+#endif
+}
+
+/**
+ * Decodes lines [first_line, last_line] (zero based, inclusive) from the block stream
+ * written by start_qv_compression. Only the blocks that overlap the range are read,
+ * located through the block index. They are read into memory a batch at a time and up
+ * to opts->threads of them are decoded concurrently, then written out in order.
+ * Because each block is decoded from memory, the decoder never reads into the following
+ * block (the memory stream pads with zeros instead), so the final symbol needs no
+ * special handling.
+ * If header and sequence files (one line per read) are given, full FASTQ records are
+ * written instead of bare quality lines
+ */
+void start_qv_decompression(FILE *fout, FILE *fin, struct quality_file_t *info, uint64_t first_line, uint64_t last_line, FILE *fheaders, FILE *fsequences) {
+	struct fastq_output_t fastq;
+	struct text_output_t *out;
+	struct qv_block_index_t index;
+	struct qv_block_batch_t batch;
+	struct qv_block_entry_t *entry;
+	struct qv_block_t *blk;
+	struct os_io_t *reads = NULL;
+	struct os_io_thread_t *io = NULL;
+	uint8_t *map;
+	uint64_t map_size = 0;
+	uint32_t threads = info->opts->threads;
+	uint32_t first_block, end_block;
+	uint32_t first, count, i;
+	uint64_t line;
+
+	if (threads < 1)
+		threads = 1;
+
+	initialize_well_seed(fin, DECOMPRESSION, info);
+	if (!read_block_index(fin, &index)) {
+		printf("Block index is missing or damaged.\n");
+		exit(1);
+	}
+
+	// Find the blocks that overlap the requested lines
+	first_block = 0;
+	while (first_block < index.count && index.blocks[first_block].first_line + index.blocks[first_block].lines <= first_line)
+		first_block += 1;
+	end_block = first_block;
+	while (end_block < index.count && index.blocks[end_block].first_line <= last_line)
+		end_block += 1;
+
+	batch.info = info;
+	batch.blocks = (struct qv_block_t *) calloc(threads, sizeof(struct qv_block_t));
+	batch.first_block = 0;
+	batch.uncompressed = 0;
+
+	// The coded blocks are decoded straight from a mapping of the file where possible.
+	// Otherwise they are read ahead by the I/O thread, a batch ahead of the decoder
+	map = map_archive(fin, &map_size);
+	if (!map) {
+		reads = (struct os_io_t *) calloc(end_block - first_block + 1, sizeof(struct os_io_t));
+		for (i = first_block; i < end_block; ++i) {
+			reads[i - first_block].fp = fin;
+			reads[i - first_block].len = index.blocks[i].length;
+			reads[i - first_block].offset = index.data_start + index.blocks[i].offset;
+		}
+		io = start_os_reader(reads, end_block - first_block, 2*threads);
+	}
+
+	// Set up FASTQ output, skipping sidecar lines for reads before the range
+	out = open_text_output(fout, 2*threads);
+	memset(&fastq, 0, sizeof(struct fastq_output_t));
+	if (fheaders && fsequences) {
+		fastq.out = out;
+		fastq.headers = fheaders;
+		fastq.sequences = fsequences;
+		fastq.line_size = 1024;
+		fastq.line = (char *) malloc(fastq.line_size);
+		for (line = 0; line < first_line; ++line) {
+			read_sidecar_line(fheaders, &fastq.line, &fastq.line_size);
+			read_sidecar_line(fsequences, &fastq.line, &fastq.line_size);
+		}
+	}
+
+	for (first = first_block; first < end_block; first += count) {
+		count = end_block - first;
+		if (count > threads)
+			count = threads;
+
+		// Find the coded blocks for this batch, and work out which of their lines are
+		// wanted. Decoding stops after the last wanted line
+		for (i = 0; i < count; ++i) {
+			blk = &batch.blocks[i];
+			blk->id = first + i;
+			entry = &index.blocks[blk->id];
+
+			blk->skip = (first_line > entry->first_line) ? (uint32_t) (first_line - entry->first_line) : 0;
+			blk->coded_lines = entry->lines;
+			blk->count = entry->lines;
+			if (last_line < entry->first_line + entry->lines - 1)
+				blk->count = (uint32_t) (last_line - entry->first_line + 1);
+
+			if (map) {
+				blk->coded = map + index.data_start + entry->offset;
+				blk->coded_len = entry->length;
+				blk->coded_mapped = 1;
+			}
+			else {
+				blk->coded = os_io_read(io, &blk->coded_len);
+				blk->coded_mapped = 0;
+			}
+		}
+		if (map)
+			prefetch_blocks(map, &index, first + count, first + 2*count, end_block);
+
+		run_parallel(decompress_block, &batch, count, threads);
+
+		for (i = 0; i < count; ++i) {
+			blk = &batch.blocks[i];
+			if (fheaders && fsequences) {
+				write_fastq_records(&fastq, blk->text, blk->count - blk->skip);
+				free(blk->text);
+			}
+			else {
+				// The output takes the block's text as it is
+				text_output_block(out, blk->text, blk->text_len);
+			}
+			blk->text = NULL;
+		}
+	}
+
+	close_text_output(out);
+	free(fastq.line);
 
-	info->lines = lineCtr;
+	if (map)
+		unmap_archive(map, map_size);
+	else
+		stop_os_io(io);
+	free(reads);
+	free(batch.blocks);
+	free_block_index(&index);
 }
@@ -1,59 +1,249 @@
 #include "qv_compressor.h"
 
 /**
- * Update stats structure used for adaptive arithmetic coding
+ * Step and halving limit for each state of the state estimator. Young contexts take big
+ * steps and forget quickly, so they settle on their first symbols, and every halving
+ * moves a context on to smaller steps and a longer memory
+ */
+static const struct {
+	uint16_t step;
+	uint16_t limit;			// 0 for the coder's rescaling condition
+} estimator_states[STATE_COUNT] = {
+	{32, 1024},
+	{16, 4096},
+	{8, 16384},
+	{4, 0},
+};
+
+/**
+ * Bytes taken by a stats record over alphabetCard symbols, rounded up to whole cache lines
+ */
+static size_t stream_stats_size(uint32_t alphabetCard, uint8_t estimator) {
+	size_t size = sizeof(struct stream_stats_t) + STREAM_PADDED(alphabetCard) * sizeof(uint16_t);
+
+	if (estimator == QV_ESTIMATOR_MIXED)
+		size += STREAM_PADDED(alphabetCard) * sizeof(uint16_t);
+	if (alphabetCard > STREAM_CUMULATIVE_MIN)
+		size += (alphabetCard + 1) * sizeof(uint16_t);
+	return (size + STREAM_RECORD_ALIGN - 1) & ~((size_t) STREAM_RECORD_ALIGN - 1);
+}
+
+/**
+ * Fills in a zeroed stats record over alphabetCard symbols, all equally likely to start
+ * with. Alphabets above STREAM_CUMULATIVE_MIN symbols also keep running sums of the
+ * counts, after them in the record, so that coding a symbol does not walk the counts
+ * @param step Count added for each symbol coded by the count estimator
+ */
+static void init_stream_stats(stream_stats_ptr_t stats, uint32_t alphabetCard, uint32_t step, uint8_t estimator) {
+	uint32_t padded = STREAM_PADDED(alphabetCard);
+	uint32_t i;
+
+	for (i = 0; i < alphabetCard; ++i) {
+		stats->counts[i] = 1;
+	}
+	if (alphabetCard > STREAM_CUMULATIVE_MIN) {
+		stats->cumCounts = stats->counts + ((estimator == QV_ESTIMATOR_MIXED) ? 2*padded : padded);
+		for (i = 0; i < alphabetCard; ++i) {
+			stats->cumCounts[i+1] = i+1;
+		}
+	}
+	stats->alphabetCard = alphabetCard;
+	stats->n = alphabetCard;
+	stats->step = step;
+	stats->estimator = estimator;
+}
+
+/**
+ * Allocates a set of adaptive stats over alphabetCard symbols in its own record
+ * @param step Count added for each symbol coded by the count estimator
+ */
+stream_stats_ptr_t alloc_stream_stats(uint32_t alphabetCard, uint32_t step, uint8_t estimator) {
+	stream_stats_ptr_t stats = (stream_stats_ptr_t) calloc_aligned(stream_stats_size(alphabetCard, estimator), STREAM_RECORD_ALIGN);
+
+	init_stream_stats(stats, alphabetCard, step, estimator);
+	return stats;
+}
+
+/**
+ * Frees what the coders built on top of a set of stats, but not its record
+ */
+static void release_stream_stat(stream_stats_ptr_t stats) {
+	free(stats->ransFreq);
+	free_tans_table(stats->tans);
+	free(stats->binary);
+}
+
+void free_stream_stat(stream_stats_ptr_t stats) {
+	release_stream_stat(stats);
+	free_aligned(stats);
+}
+
+/**
+ * Rebuilds the running sums, if any, after the counts change all at once
+ */
+static void sum_stream_stats(stream_stats_ptr_t stats) {
+	uint16_t *cum = stats->cumCounts;
+	uint32_t i;
+
+	if (cum) {
+		for (i = 0; i < stats->alphabetCard; ++i) {
+			cum[i+1] = cum[i] + stats->counts[i];
+		}
+	}
+}
+
+/**
+ * Halves the counts, keeping every symbol that was possible at 1 or more. The padding
+ * stays zero, so the loop runs over whole vectors without a branch
+ */
+static void rescale_stream_stats(stream_stats_ptr_t stats) {
+	uint16_t *counts = stats->counts;
+	uint32_t i, n = 0, padded = STREAM_PADDED(stats->alphabetCard);
+
+	for (i = 0; i < padded; ++i) {
+		counts[i] = (counts[i] >> 1) + (counts[i] != 0);
+		n += counts[i];
+	}
+	stats->n = n;
+	sum_stream_stats(stats);
+}
+
+/**
+ * Halves the fast part of the mixed estimator's counts, leaving the slow part alone
+ */
+static void rescale_fast_stats(stream_stats_ptr_t stats) {
+	uint16_t *counts = stats->counts;
+	uint32_t padded = STREAM_PADDED(stats->alphabetCard);
+	uint16_t *fast = counts + padded;
+	uint32_t i, fast_n = 0, dropped = 0;
+
+	for (i = 0; i < padded; ++i) {
+		dropped += fast[i] - (fast[i] >> 1);
+		counts[i] -= fast[i] - (fast[i] >> 1);
+		fast[i] >>= 1;
+		fast_n += fast[i];
+	}
+	stats->n -= dropped;
+	stats->fastN = fast_n;
+}
+
+/**
+ * Halves the slow part of the mixed estimator's counts, keeping each possible symbol's
+ * slow count at 1 or more
+ */
+static void rescale_slow_stats(stream_stats_ptr_t stats) {
+	uint16_t *counts = stats->counts;
+	uint32_t padded = STREAM_PADDED(stats->alphabetCard);
+	uint16_t *fast = counts + padded;
+	uint32_t i, n = 0, slow;
+
+	for (i = 0; i < padded; ++i) {
+		slow = counts[i] - fast[i];
+		counts[i] = (slow >> 1) + (slow != 0) + fast[i];
+		n += counts[i];
+	}
+	stats->n = n;
+}
+
+/**
+ * Adds step to symbol x's count and to the running sums above it
+ */
+static inline void add_stream_count(stream_stats_ptr_t stats, uint32_t x, uint32_t step) {
+	uint16_t *cum = stats->cumCounts;
+	uint32_t i, card = stats->alphabetCard;
+
+	stats->counts[x] += step;
+	stats->n += step;
+	if (cum) {
+		for (i = x+1; i <= card; ++i) {
+			cum[i] += step;
+		}
+	}
+}
+
+/**
+ * Update stats structure used for adaptive arithmetic coding, with the stats' estimator:
+ * - QV_ESTIMATOR_COUNT adds a fixed step and halves the counts when n passes r
+ * - QV_ESTIMATOR_MIXED keeps a slow and a fast count for each symbol, each halved at
+ *   its own limit, and codes with their sum, so recent symbols weigh more without the
+ *   long run statistics being lost
+ * - QV_ESTIMATOR_STATE takes the step and limit from the context's state, which moves
+ *   on at every halving
+ * Any running sums above x move up with the count, and are rebuilt when the counts are halved
  * @param stats Pointer to stats structure
  * @param x Symbol to update
- * @param r Rescaling condition (if n > r, rescale all stats)
+ * @param r Rescaling condition (if n > r, rescale all stats), at most STREAM_TOTAL_MAX
  */
 void update_stats(stream_stats_ptr_t stats, uint32_t x, uint32_t r) {
-    uint32_t i = 0;
+	uint32_t limit;
 
-	stats->counts[x] += stats->step;
-	stats->n += stats->step;
+	if (stats->estimator == QV_ESTIMATOR_MIXED) {
+		add_stream_count(stats, x, MIXED_SLOW_STEP + MIXED_FAST_STEP);
+		stats->counts[x + STREAM_PADDED(stats->alphabetCard)] += MIXED_FAST_STEP;
+		stats->fastN += MIXED_FAST_STEP;
 
-	if (stats->n > r) {
-		stats->n = 0;
-		for (i = 0; i < stats->alphabetCard; ++i) {
-			if (stats->counts[i]) {
-				stats->counts[i] >>= 1;
-				stats->counts[i] += 1;
-				stats->n += stats->counts[i];
-			}
+		if (stats->fastN > MIXED_FAST_MAX || stats->n - stats->fastN > MIXED_SLOW_MAX) {
+			if (stats->fastN > MIXED_FAST_MAX)
+				rescale_fast_stats(stats);
+			if (stats->n - stats->fastN > MIXED_SLOW_MAX)
+				rescale_slow_stats(stats);
+			sum_stream_stats(stats);
+		}
+	}
+	else if (stats->estimator == QV_ESTIMATOR_STATE) {
+		add_stream_count(stats, x, estimator_states[stats->state].step);
+
+		limit = estimator_states[stats->state].limit;
+		if (limit == 0 || limit > r)
+			limit = r;
+		if (stats->n > limit) {
+			rescale_stream_stats(stats);
+			if (stats->state < STATE_COUNT-1)
+				stats->state += 1;
 		}
 	}
+	else {
+		add_stream_count(stats, x, stats->step);
+		if (stats->n > r)
+			rescale_stream_stats(stats);
+	}
 }
 
 /**
  * Initialize stats structures used for adaptive arithmetic coding based on
  * the number of contexts required to handle the set of conditional quantizers
- * that we have (one context per quantizer)
+ * that we have (one context per quantizer). A column's contexts are records of the
+ * same size, one after another in a single allocation, so neighbouring contexts share
+ * pages and the decoder's working set stays small
  */
-stream_stats_ptr_t **initialize_stream_stats(struct cond_quantizer_list_t *q_list) {
+stream_stats_ptr_t **initialize_stream_stats(struct cond_quantizer_list_t *q_list, uint8_t estimator) {
     stream_stats_ptr_t **s;
-    uint32_t i = 0, j = 0, k = 0;
+    uint32_t i = 0, j = 0;
+	uint32_t contexts;
+	size_t stride, size;
+	uint8_t *records;
     
     s = (stream_stats_ptr_t **) calloc(q_list->columns, sizeof(stream_stats_ptr_t *));
 
     // Allocate jagged array, one set of stats per column
     for (i = 0; i < q_list->columns; ++i) {
 		// And for each column, one set of stats per low/high quantizer per previous context
-        s[i] = (stream_stats_ptr_t *) calloc(2*q_list->input_alphabets[i]->size, sizeof(stream_stats_ptr_t));
+		contexts = 2*q_list->input_alphabets[i]->size;
+        s[i] = (stream_stats_ptr_t *) calloc(contexts, sizeof(stream_stats_ptr_t));
+
+		stride = 0;
+		for (j = 0; j < contexts; ++j) {
+			size = stream_stats_size(q_list->q[i][j]->output_alphabet->size, estimator);
+			if (size > stride)
+				stride = size;
+		}
+		records = (uint8_t *) calloc_aligned(contexts * stride, STREAM_RECORD_ALIGN);
         
 		// Finally each individual stat structure needs to be filled in uniformly
-        for (j = 0; j < 2*q_list->input_alphabets[i]->size; ++j) {
-            s[i][j] = (stream_stats_ptr_t) calloc(1, sizeof(struct stream_stats_t));
-            s[i][j]->counts = (uint32_t *) calloc(q_list->q[i][j]->output_alphabet->size, sizeof(uint32_t));
-            
-            // Initialize the quantizer's stats uniformly
-            for (k = 0; k < q_list->q[i][j]->output_alphabet->size; k++) {
-                s[i][j]->counts[k] = 1;
-            }
-			s[i][j]->n = q_list->q[i][j]->output_alphabet->size;
-            s[i][j]->alphabetCard = q_list->q[i][j]->output_alphabet->size;
-            
+        for (j = 0; j < contexts; ++j) {
             // Step size is 8 counts per symbol seen to speed convergence
-            s[i][j]->step = 8;
+            s[i][j] = (stream_stats_ptr_t) (records + j*stride);
+			init_stream_stats(s[i][j], q_list->q[i][j]->output_alphabet->size, 8, estimator);
         }
     }
     
@@ -61,16 +251,34 @@ stream_stats_ptr_t **initialize_stream_stats(struct cond_quantizer_list_t *q_lis
 }
 
 /**
- * @todo add cluster stats
+ * Deallocates the stats structures created by initialize_stream_stats for the given
+ * set of conditional quantizers
  */
-arithStream initialize_arithStream(FILE *fout, uint8_t decompressor_flag, struct quality_file_t *info) {
-    arithStream as;
+void free_stream_stats(stream_stats_ptr_t **s, struct cond_quantizer_list_t *q_list) {
+	uint32_t i, j;
+
+	for (i = 0; i < q_list->columns; ++i) {
+		for (j = 0; j < 2*q_list->input_alphabets[i]->size; ++j) {
+			release_stream_stat(s[i][j]);
+		}
+		free_aligned(s[i][0]);
+		free(s[i]);
+	}
+	free(s);
+}
+
+/**
+ * Sets up the seed for the WELL state that drives quantizer selection. The encoder
+ * picks a seed and writes it to the file, the decoder reads it back. Every block is
+ * coded with its own state derived from this seed by well_1024a_fork
+ */
+void initialize_well_seed(FILE *fp, uint8_t decompressor_flag, struct quality_file_t *info) {
 	uint32_t i;
 
 	memset(&info->well, 0, sizeof(struct well_state_t));
 
     if (decompressor_flag) {
-        fread(info->well.state, sizeof(uint32_t), 32, fout);
+        fread(info->well.state, sizeof(uint32_t), 32, fp);
     }
     else {
         // Initialize WELL state vector with libc rand
@@ -86,30 +294,61 @@ arithStream initialize_arithStream(FILE *fout, uint8_t decompressor_flag, struct
         // Write the initial WELL state vector to the file first (fixed size of 32 bytes)
 		// @todo strictly this needs to be stored in network order because we're interpreting it as a 32 bit int
 		// but I am a bit too lazy for that right now
-        fwrite(info->well.state, sizeof(uint32_t), 32, fout);
+        fwrite(info->well.state, sizeof(uint32_t), 32, fp);
 	}
 
 	// Must start at zero
 	info->well.n = 0;
-    
+}
+
+/**
+ * Creates a fresh arithmetic coder and set of adaptive stats on top of the given
+ * stream. Each block gets its own so that blocks can be coded independently
+ * @todo add cluster stats
+ */
+arithStream initialize_arithStream(osStream os, uint8_t decompressor_flag, struct quality_file_t *info) {
+    arithStream as;
+	uint32_t i;
+	uint32_t length_symbols;
+
     as = (arithStream) calloc(1, sizeof(struct arithStream_t));
 
-	as->cluster_stats = (stream_stats_ptr_t) calloc(1, sizeof(struct stream_stats_t));
-	as->cluster_stats->step = 8;
-	as->cluster_stats->counts = (uint32_t *) calloc(info->cluster_count, sizeof(uint32_t));
-	as->cluster_stats->alphabetCard = info->cluster_count;
-	as->cluster_stats->n = info->cluster_count;
+	// Lengths are coded directly unless the reads are too long for one context to hold them
+	as->length_classes = (info->columns > MAX_MODEL_COLUMNS);
+	length_symbols = as->length_classes ? LENGTH_CLASSES : info->columns + 1;
+
+	as->cluster_stats = alloc_stream_stats(info->cluster_count, 8, info->estimator);
 
 	as->stats = (stream_stats_ptr_t ***) calloc(info->cluster_count, sizeof(stream_stats_ptr_t **));
+	as->length_stats = (stream_stats_ptr_t *) calloc(info->cluster_count, sizeof(stream_stats_ptr_t));
 	for (i = 0; i < info->cluster_count; ++i) {
-    	as->stats[i] = initialize_stream_stats(info->clusters->clusters[i].qlist);
-		as->cluster_stats->counts[i] = 1;
+    	as->stats[i] = initialize_stream_stats(info->clusters->clusters[i].qlist, info->estimator);
+
+		// Lengths from 0 to columns (or their bit count classes), all equally likely to start
+		as->length_stats[i] = alloc_stream_stats(length_symbols, 8, info->estimator);
 	}
+
+	// Never updated, so 0 and 1 stay equally likely
+	as->bit_stats = alloc_stream_stats(2, 0, QV_ESTIMATOR_COUNT);
     
 	as->a = initialize_arithmetic_encoder(m_arith);
-	as->os = alloc_os_stream(fout, decompressor_flag);
+	as->os = os;
+	as->coder = info->coder;
 
-	if (decompressor_flag)
+	if (as->coder == QV_CODER_RANGE || as->coder == QV_CODER_BINARY) {
+		as->rc = initialize_range_coder();
+		if (decompressor_flag)
+			range_decoder_start(as->rc, as->os);
+	}
+	else if (as->coder == QV_CODER_RANS) {
+		as->rans = initialize_rans_coder(decompressor_flag, info->lanes);
+	}
+	else if (as->coder == QV_CODER_TANS) {
+		as->tans = initialize_tans_coder(decompressor_flag, info->lanes);
+		if (decompressor_flag)
+			tans_read_tables(as, info);
+	}
+	else if (decompressor_flag)
 		as->a->t = stream_read_bits(as->os, as->a->m);
 	else
 		as->a->t = 0;
@@ -117,9 +356,36 @@ arithStream initialize_arithStream(FILE *fout, uint8_t decompressor_flag, struct
     return as;
 }
 
-qv_compressor initialize_qv_compressor(FILE *fout, uint8_t streamDirection, struct quality_file_t *info) {
+/**
+ * Deallocates an arithmetic stream along with its coder, stats and underlying stream
+ */
+void free_arithStream(arithStream as, struct quality_file_t *info) {
+	uint32_t i;
+
+	for (i = 0; i < info->cluster_count; ++i) {
+		free_stream_stats(as->stats[i], info->clusters->clusters[i].qlist);
+		free_stream_stat(as->length_stats[i]);
+	}
+	free(as->stats);
+	free(as->length_stats);
+	free_stream_stat(as->bit_stats);
+	free_stream_stat(as->cluster_stats);
+	free(as->a);
+	free(as->rc);
+	free_rans_coder(as->rans);
+	free_tans_coder(as->tans);
+	free_os_stream(as->os);
+	free(as);
+}
+
+qv_compressor initialize_qv_compressor(osStream os, uint8_t streamDirection, struct quality_file_t *info) {
     qv_compressor s;
     s = calloc(1, sizeof(struct qv_compressor_t));
-    s->Quals = initialize_arithStream(fout, streamDirection, info);
+    s->Quals = initialize_arithStream(os, streamDirection, info);
     return s;
 }
+
+void free_qv_compressor(qv_compressor qvc, struct quality_file_t *info) {
+	free_arithStream(qvc->Quals, info);
+	free(qvc);
+}
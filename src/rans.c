@@ -0,0 +1,189 @@
+#include <assert.h>
+#include "qv_compressor.h"
+
+// Largest alphabet whose scaled ranges are searched one at a time when decoding
+#define RANS_LINEAR_SEARCH_MAX	16
+
+Rans_code initialize_rans_coder(uint8_t decompressor_flag, uint32_t lanes) {
+	Rans_code rans = (Rans_code) calloc(1, sizeof(struct rans_coder_t));
+
+	assert(lanes >= 1 && lanes <= QV_MAX_LANES);
+	rans->lanes = lanes;
+	if (!decompressor_flag) {
+		rans->symbols = (uint32_t *) malloc(RANS_CHUNK_SYMBOLS * sizeof(uint32_t));
+		rans->lane_of = (uint8_t *) malloc(RANS_CHUNK_SYMBOLS * sizeof(uint8_t));
+
+		// A symbol takes at most RANS_SCALE_BITS bits, plus up to a byte of renormalization
+		rans->out = (uint8_t *) malloc(3*RANS_CHUNK_SYMBOLS + 4*QV_MAX_LANES);
+	}
+	return rans;
+}
+
+void free_rans_coder(Rans_code rans) {
+	if (!rans)
+		return;
+	free(rans->symbols);
+	free(rans->lane_of);
+	free(rans->out);
+	free(rans);
+}
+
+/**
+ * Scales the adaptive counts to add up to exactly RANS_TOTAL. Every symbol keeps at
+ * least 1, and the rounding left over goes to the most frequent symbol
+ */
+static void rans_build_model(stream_stats_ptr_t stats) {
+	uint32_t card = stats->alphabetCard;
+	uint32_t spare = RANS_TOTAL - card;
+	uint32_t i, f, sum = 0, top = 0;
+	uint16_t *cum;
+
+	if (!stats->ransFreq) {
+		stats->ransFreq = (uint16_t *) calloc(2*card + 1, sizeof(uint16_t));
+		stats->ransInterval = 1;
+	}
+
+	for (i = 0; i < card; ++i) {
+		f = 1 + (uint32_t) (((uint64_t) stats->counts[i] * spare) / stats->n);
+		stats->ransFreq[i] = f;
+		sum += f;
+		if (f > stats->ransFreq[top])
+			top = i;
+	}
+	stats->ransFreq[top] += RANS_TOTAL - sum;
+
+	cum = RANS_CUM(stats);
+	for (i = 0; i < card; ++i) {
+		cum[i+1] = cum[i] + stats->ransFreq[i];
+	}
+
+	stats->ransAge = 0;
+}
+
+/**
+ * Brings the scaled model up to date with the counts. It is rebuilt after 1, 2, 4, ...
+ * symbols, and then every RANS_REFRESH_MAX symbols, so young contexts adapt quickly
+ * while the rebuilds of busy ones cost little per symbol. The encoder and decoder call
+ * this at the same points, before the counts are updated
+ */
+static inline void rans_refresh_model(stream_stats_ptr_t stats) {
+	if (!stats->ransFreq) {
+		rans_build_model(stats);
+	}
+	else if (stats->ransAge >= stats->ransInterval) {
+		rans_build_model(stats);
+		if (stats->ransInterval < RANS_REFRESH_MAX)
+			stats->ransInterval *= 2;
+	}
+	stats->ransAge += 1;
+}
+
+/**
+ * Codes the recorded symbols backwards, so that the decoder gets them forwards, and
+ * appends them to the stream after the final states. Each symbol moves only its own
+ * lane's state, but the bytes of all lanes go out in the one order the decoder reads them
+ */
+static void rans_flush_chunk(Rans_code rans, osStream os) {
+	uint8_t *end = rans->out + 3*RANS_CHUNK_SYMBOLS + 4*QV_MAX_LANES;
+	uint8_t *ptr = end;
+	uint32_t x[QV_MAX_LANES], start, freq, x_max, lane;
+	uint32_t i;
+
+	for (lane = 0; lane < rans->lanes; ++lane)
+		x[lane] = RANS_L;
+
+	for (i = rans->count; i > 0; --i) {
+		start = rans->symbols[i-1] & 0xffff;
+		freq = rans->symbols[i-1] >> 16;
+		lane = rans->lane_of[i-1];
+
+		x_max = ((RANS_L >> RANS_SCALE_BITS) << 8) * freq;
+		while (x[lane] >= x_max) {
+			*--ptr = (uint8_t) x[lane];
+			x[lane] >>= 8;
+		}
+		x[lane] = ((x[lane] / freq) << RANS_SCALE_BITS) + (x[lane] % freq) + start;
+	}
+
+	for (lane = rans->lanes; lane > 0; --lane) {
+		ptr -= 4;
+		ptr[0] = (uint8_t) (x[lane-1] >> 24);
+		ptr[1] = (uint8_t) (x[lane-1] >> 16);
+		ptr[2] = (uint8_t) (x[lane-1] >> 8);
+		ptr[3] = (uint8_t) x[lane-1];
+	}
+	stream_write_bytes(os, ptr, (uint32_t) (end - ptr));
+
+	rans->count = 0;
+}
+
+void rans_encoder_step(Rans_code rans, stream_stats_ptr_t stats, uint32_t x, osStream os) {
+	assert(x < stats->alphabetCard);
+
+	rans_refresh_model(stats);
+	rans->symbols[rans->count] = RANS_CUM(stats)[x] | ((uint32_t) stats->ransFreq[x] << 16);
+	rans->lane_of[rans->count] = (uint8_t) rans->lane;
+	rans->count += 1;
+	if (rans->count == RANS_CHUNK_SYMBOLS)
+		rans_flush_chunk(rans, os);
+}
+
+int rans_encoder_last_step(Rans_code rans, osStream os) {
+	if (rans->count > 0)
+		rans_flush_chunk(rans, os);
+	stream_write_buffer(os);
+
+	return os->written;
+}
+
+/**
+ * Finds the symbol whose scaled range holds slot
+ */
+static inline uint32_t rans_find_symbol(stream_stats_ptr_t stats, uint32_t slot) {
+	const uint16_t *above = RANS_CUM(stats) + 1;
+	uint32_t base = 0, len = stats->alphabetCard, half;
+
+	if (len <= RANS_LINEAR_SEARCH_MAX) {
+		while (above[base] <= slot)
+			base += 1;
+		return base;
+	}
+
+	while (len > 1) {
+		half = len >> 1;
+		base = (above[base + half - 1] <= slot) ? base + half : base;
+		len -= half;
+	}
+	return base + (above[base] <= slot);
+}
+
+/**
+ * Decodes the next symbol with the current lane's state, which is a lookup of the
+ * state's low bits in the scaled ranges followed by a multiply, with no division
+ */
+uint32_t rans_decoder_step(Rans_code rans, stream_stats_ptr_t stats, osStream is) {
+	uint32_t x, slot, s, lane;
+
+	if (rans->count == 0) {
+		for (lane = 0; lane < rans->lanes; ++lane) {
+			x = (uint32_t) stream_read_byte(is) << 24;
+			x |= (uint32_t) stream_read_byte(is) << 16;
+			x |= (uint32_t) stream_read_byte(is) << 8;
+			x |= stream_read_byte(is);
+			rans->state[lane] = x;
+		}
+		rans->count = RANS_CHUNK_SYMBOLS;
+	}
+
+	x = rans->state[rans->lane];
+	rans_refresh_model(stats);
+	slot = x & (RANS_TOTAL - 1);
+	s = rans_find_symbol(stats, slot);
+	x = stats->ransFreq[s] * (x >> RANS_SCALE_BITS) + slot - RANS_CUM(stats)[s];
+	while (x < RANS_L)
+		x = (x << 8) | stream_read_byte(is);
+
+	rans->state[rans->lane] = x;
+	rans->count -= 1;
+	return s;
+}
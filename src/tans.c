@@ -0,0 +1,373 @@
+#include <assert.h>
+#include "qv_compressor.h"
+
+// Symbols are spread over a table of size states in steps of this size, which is odd (for tables
+// of at least TANS_MIN_LOG) so every state is visited
+#define TANS_SPREAD_STEP(size)	(((size) >> 1) + ((size) >> 3) + 3)
+
+Tans_code initialize_tans_coder(uint8_t decompressor_flag, uint32_t lanes) {
+	Tans_code tans = (Tans_code) calloc(1, sizeof(struct tans_coder_t));
+
+	assert(lanes >= 1 && lanes <= QV_MAX_LANES);
+	tans->lanes = lanes;
+	if (!decompressor_flag) {
+		tans->tables = (struct tans_table_t **) malloc(TANS_CHUNK_SYMBOLS * sizeof(struct tans_table_t *));
+		tans->symbols = (uint16_t *) malloc(TANS_CHUNK_SYMBOLS * sizeof(uint16_t));
+		tans->lane_of = (uint8_t *) malloc(TANS_CHUNK_SYMBOLS * sizeof(uint8_t));
+		tans->bits = (uint32_t *) malloc(TANS_CHUNK_SYMBOLS * sizeof(uint32_t));
+	}
+	return tans;
+}
+
+void free_tans_coder(Tans_code tans) {
+	if (!tans)
+		return;
+	free(tans->tables);
+	free(tans->symbols);
+	free(tans->lane_of);
+	free(tans->bits);
+	free(tans);
+}
+
+void free_tans_table(struct tans_table_t *table) {
+	if (!table)
+		return;
+	free(table->counts);
+	free(table->freq);
+	free(table->next);
+	free(table);
+}
+
+/**
+ * Calls visit on every set of stats in the stream, in the same order for the encoder
+ * and the decoder
+ */
+static void tans_visit_stats(arithStream as, struct quality_file_t *info, void (*visit)(arithStream, stream_stats_ptr_t)) {
+	struct cond_quantizer_list_t *qlist;
+	uint32_t i, j, k;
+
+	visit(as, as->cluster_stats);
+	for (i = 0; i < info->cluster_count; ++i) {
+		visit(as, as->length_stats[i]);
+		qlist = info->clusters->clusters[i].qlist;
+		for (j = 0; j < qlist->columns; ++j) {
+			for (k = 0; k < 2*qlist->input_alphabets[j]->size; ++k) {
+				visit(as, as->stats[i][j][k]);
+			}
+		}
+	}
+	visit(as, as->bit_stats);
+}
+
+/**
+ * Allocates a table for card symbols, with the running sums of freq filled in later,
+ * and room for entries 16 bit entries of decoding tables
+ */
+static struct tans_table_t *alloc_tans_table(uint32_t card, uint32_t entries) {
+	struct tans_table_t *table = (struct tans_table_t *) calloc(1, sizeof(struct tans_table_t) + entries * sizeof(uint16_t));
+
+	table->freq = (uint16_t *) calloc(2*card, sizeof(uint16_t));
+	table->start = table->freq + card;
+	return table;
+}
+
+/**
+ * Gives the context a table with zero counts for the block. The adaptive counts are too
+ * narrow for a whole block, so the counting pass keeps its own
+ */
+static void tans_zero_counts(arithStream as, stream_stats_ptr_t stats) {
+	free_tans_table(stats->tans);
+	stats->tans = alloc_tans_table(stats->alphabetCard, 0);
+	stats->tans->counts = (uint32_t *) calloc(stats->alphabetCard, sizeof(uint32_t));
+}
+
+/**
+ * Starts the encoder's counting pass. Until the tables are written, coding a symbol only
+ * counts it
+ */
+void tans_begin_count(arithStream as, struct quality_file_t *info) {
+	tans_visit_stats(as, info, tans_zero_counts);
+	as->tans->counting = 1;
+}
+
+/**
+ * Builds the coding tables for the frequencies in table->freq. Each symbol gets freq
+ * states, spread over the table, and the k-th state of symbol s (in state order)
+ * decodes to s and is reached by encoding s from any state x with x >> bits == freq+k
+ */
+static void tans_build_table(struct tans_table_t *table, uint32_t card, uint8_t decoder) {
+	uint32_t size = 1 << table->log;
+	uint16_t *spread = (uint16_t *) malloc(size * sizeof(uint16_t));
+	uint16_t *seen = (uint16_t *) calloc(card, sizeof(uint16_t));
+	uint32_t pos = 0, s, k, u;
+
+	for (s = 0; s < card; ++s) {
+		for (k = 0; k < table->freq[s]; ++k) {
+			spread[pos] = s;
+			pos = (pos + TANS_SPREAD_STEP(size)) & (size - 1);
+		}
+	}
+
+	if (decoder) {
+		// Only a context with a great many symbols (line lengths) has no room for them in the entries
+		if (!TANS_ENTRY_FITS(card, table->log))
+			table->symbols = table->decode + size;
+		for (u = 0; u < size; ++u) {
+			s = spread[u];
+			table->decode[u] = TANS_ENTRY(table->symbols ? 0 : s, table->freq[s] + seen[s], table->log);
+			seen[s] += 1;
+		}
+		if (table->symbols)
+			memcpy(table->symbols, spread, size * sizeof(uint16_t));
+	}
+	else {
+		table->next = (uint16_t *) malloc(size * sizeof(uint16_t));
+		for (u = 0; u < size; ++u) {
+			s = spread[u];
+			table->next[table->start[s] + seen[s]] = u;
+			seen[s] += 1;
+		}
+	}
+
+	free(spread);
+	free(seen);
+}
+
+static void tans_sum_freq(struct tans_table_t *table, uint32_t card) {
+	uint32_t s, sum = 0;
+
+	for (s = 0; s < card; ++s) {
+		table->start[s] = sum;
+		sum += table->freq[s];
+	}
+	assert(sum == (1U << table->log));
+}
+
+/**
+ * Table log for a context that uses the given number of symbols in a block. A context
+ * with a single symbol needs one state, and codes it with no bits at all
+ */
+static uint32_t tans_table_log(uint32_t used) {
+	uint32_t log;
+
+	if (used <= 1)
+		return 0;
+	log = 32 - count_leading_zeros(used - 1) + TANS_LOG_EXTRA;
+	if (log < TANS_MIN_LOG)
+		log = TANS_MIN_LOG;
+	return (log < TANS_TABLE_LOG) ? log : TANS_TABLE_LOG;
+}
+
+/**
+ * Elias gamma code for v >= 1, which keeps the many small frequencies short
+ */
+static void write_gamma(osStream os, uint32_t v) {
+	uint32_t bits = 32 - count_leading_zeros(v);
+
+	stream_write_bits(os, 0, bits - 1);
+	stream_write_bits(os, v, bits);
+}
+
+static uint32_t read_gamma(osStream is) {
+	uint32_t zeros = 0;
+
+	while (zeros < 31 && !stream_read_bit(is))
+		zeros += 1;
+	return (1U << zeros) | stream_read_bits(is, zeros);
+}
+
+/**
+ * Scales a context's counts to its table size and writes them: a used flag, the table
+ * log, then the frequency of every symbol but the last, which is what is left over
+ */
+static void tans_write_table(arithStream as, stream_stats_ptr_t stats) {
+	struct tans_table_t *table = stats->tans;
+	const uint32_t *counts = table->counts;
+	uint32_t card = stats->alphabetCard;
+	uint64_t total = 0;
+	uint32_t used = 0, size, spare, sum = 0, top = 0, s;
+
+	for (s = 0; s < card; ++s) {
+		total += counts[s];
+		used += (counts[s] > 0);
+	}
+
+	stream_write_bit(as->os, total > 0);
+	if (total == 0) {
+		free_tans_table(table);
+		stats->tans = NULL;
+		return;
+	}
+
+	table->log = (uint8_t) tans_table_log(used);
+	table->shift = TANS_TABLE_LOG - table->log;
+	size = 1 << table->log;
+	stream_write_bits(as->os, table->log, 4);
+
+	// Every symbol that occurs keeps at least one state, and the rounding goes to the most common
+	spare = size - used;
+	for (s = 0; s < card; ++s) {
+		if (counts[s])
+			table->freq[s] = 1 + (uint32_t) (((uint64_t) counts[s] * spare) / total);
+		sum += table->freq[s];
+		if (table->freq[s] > table->freq[top])
+			top = s;
+	}
+	table->freq[top] += size - sum;
+
+	for (s = 0; s + 1 < card; ++s) {
+		write_gamma(as->os, table->freq[s] + 1);
+	}
+
+	free(table->counts);
+	table->counts = NULL;
+	tans_sum_freq(table, card);
+	tans_build_table(table, card, 0);
+}
+
+/**
+ * Ends the counting pass by storing the tables for the counts, after which coding a
+ * symbol codes it
+ */
+void tans_write_tables(arithStream as, struct quality_file_t *info) {
+	tans_visit_stats(as, info, tans_write_table);
+	as->tans->counting = 0;
+	as->tans->count = 0;
+}
+
+static void tans_read_table(arithStream as, stream_stats_ptr_t stats) {
+	struct tans_table_t *table;
+	uint32_t card = stats->alphabetCard;
+	uint32_t log, sum = 0, s;
+
+	if (!stream_read_bit(as->os))
+		return;
+
+	log = stream_read_bits(as->os, 4);
+	if (log > TANS_TABLE_LOG) {
+		printf("Damaged tANS table in coded block.\n");
+		exit(1);
+	}
+
+	// Decoding entries, then the symbols of the states if the entries have no room for them
+	table = alloc_tans_table(card, (TANS_ENTRY_FITS(card, log) ? 1 : 2) << log);
+	for (s = 0; s + 1 < card && sum <= (1U << log); ++s) {
+		table->freq[s] = read_gamma(as->os) - 1;
+		sum += table->freq[s];
+	}
+	if (sum > (1U << log)) {
+		printf("Damaged tANS table in coded block.\n");
+		exit(1);
+	}
+	table->log = (uint8_t) log;
+	table->shift = TANS_TABLE_LOG - log;
+	table->freq[card-1] = (1 << log) - sum;
+
+	tans_sum_freq(table, card);
+	tans_build_table(table, card, 1);
+	stats->tans = table;
+
+	// Decoding only needs the entries, so the next tables can pack in behind this one
+	free(table->freq);
+	table->freq = NULL;
+}
+
+/**
+ * Reads the tables stored at the start of a block
+ */
+void tans_read_tables(arithStream as, struct quality_file_t *info) {
+	tans_visit_stats(as, info, tans_read_table);
+}
+
+/**
+ * Codes the recorded symbols backwards, each with its lane's state, saving the bits each
+ * one gives out, then writes the final states and the bits in the order the decoder
+ * reads them
+ */
+static void tans_flush_chunk(Tans_code tans, osStream os) {
+	struct tans_table_t *table;
+	uint32_t x[QV_MAX_LANES], s, f, k, bits, max_bits, lane;
+	uint32_t i;
+
+	for (lane = 0; lane < tans->lanes; ++lane)
+		x[lane] = TANS_SIZE;
+
+	for (i = tans->count; i > 0; --i) {
+		table = tans->tables[i-1];
+		s = tans->symbols[i-1];
+		lane = tans->lane_of[i-1];
+		f = table->freq[s];
+
+		// Shift the state down into [f, 2f) above the low bits the table passes through
+		f <<= table->shift;
+		max_bits = TANS_TABLE_LOG - (31 - count_leading_zeros(f));
+		bits = (x[lane] >= (f << max_bits)) ? max_bits : max_bits - 1;
+		tans->bits[i-1] = (x[lane] & ((1U << bits) - 1)) | (bits << 16);
+		k = (x[lane] >> bits) - f;
+		x[lane] = TANS_SIZE + (table->next[table->start[s] + (k >> table->shift)] << table->shift) + (k & ((1U << table->shift) - 1));
+	}
+
+	for (lane = 0; lane < tans->lanes; ++lane)
+		stream_write_bits(os, x[lane] - TANS_SIZE, TANS_TABLE_LOG);
+	for (i = 0; i < tans->count; ++i) {
+		stream_write_bits(os, tans->bits[i] & 0xffff, tans->bits[i] >> 16);
+	}
+
+	tans->count = 0;
+}
+
+void tans_encoder_step(Tans_code tans, stream_stats_ptr_t stats, uint32_t x, osStream os) {
+	assert(x < stats->alphabetCard);
+
+	if (tans->counting) {
+		stats->tans->counts[x] += 1;
+		return;
+	}
+
+	tans->tables[tans->count] = stats->tans;
+	tans->symbols[tans->count] = x;
+	tans->lane_of[tans->count] = (uint8_t) tans->lane;
+	tans->count += 1;
+	if (tans->count == TANS_CHUNK_SYMBOLS)
+		tans_flush_chunk(tans, os);
+}
+
+int tans_encoder_last_step(Tans_code tans, osStream os) {
+	if (tans->count > 0)
+		tans_flush_chunk(tans, os);
+	stream_finish_byte(os);
+
+	return os->written;
+}
+
+/**
+ * Decodes the next symbol with a single table lookup on the current lane's state, and
+ * no model update
+ */
+uint32_t tans_decoder_step(Tans_code tans, stream_stats_ptr_t stats, osStream is) {
+	struct tans_table_t *table = stats->tans;
+	uint32_t e, x, u, y, bits, lane;
+
+	if (tans->count == 0) {
+		for (lane = 0; lane < tans->lanes; ++lane)
+			tans->state[lane] = stream_read_bits(is, TANS_TABLE_LOG);
+		tans->count = TANS_CHUNK_SYMBOLS;
+	}
+
+	if (!table) {
+		printf("Coded block uses a context without a tANS table.\n");
+		exit(1);
+	}
+
+	// The entry gives the y that the encoder shifted the top log bits of its state down to,
+	// and shifting y back up over the bits read here, below which the low bits pass
+	// through, gives the state the encoder had before
+	x = tans->state[tans->lane];
+	u = x >> table->shift;
+	e = table->decode[u];
+	y = TANS_ENTRY_Y(e, table->log);
+	bits = table->log - (31 - count_leading_zeros(y));
+	tans->state[tans->lane] = (((y << bits) - (1U << table->log)) << table->shift) + ((x & ((1U << table->shift) - 1)) << bits) + stream_read_bits(is, bits);
+	tans->count -= 1;
+	return table->symbols ? table->symbols[u] : TANS_ENTRY_SYMBOL(e, table->log);
+}
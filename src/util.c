@@ -91,3 +91,162 @@ int cb_log2(int x) {
 		return res;
 	return res+1;
 }
+
+/**
+ * Allocates size zeroed bytes starting on a multiple of align, such as a cache line
+ */
+void *calloc_aligned(size_t size, size_t align) {
+	void *ptr;
+
+#if defined(LINUX) || defined(__APPLE__)
+	if (posix_memalign(&ptr, align, size) != 0)
+		return NULL;
+#else
+	ptr = _aligned_malloc(size, align);
+	if (!ptr)
+		return NULL;
+#endif
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+void free_aligned(void *ptr) {
+#if defined(LINUX) || defined(__APPLE__)
+	free(ptr);
+#else
+	_aligned_free(ptr);
+#endif
+}
+
+/**
+ * Reports the peak resident memory, which getrusage gives in kilobytes on Linux and in
+ * bytes on OS X
+ */
+uint64_t peak_resident_memory() {
+#if defined(LINUX) || defined(__APPLE__)
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef LINUX
+	return ((uint64_t) usage.ru_maxrss) << 10;
+#else
+	return (uint64_t) usage.ru_maxrss;
+#endif
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Shared state for a run_parallel() call. Workers claim the next job index
+ * under the lock until every job has been handed out
+ */
+struct parallel_run_t {
+	parallel_job_t fn;
+	void *ctx;
+	uint32_t jobs;
+	uint32_t next;
+#if defined(LINUX) || defined(__APPLE__)
+	pthread_mutex_t lock;
+#else
+	CRITICAL_SECTION lock;
+#endif
+};
+
+/**
+ * Claims the next unstarted job, returns 0 when there are none left
+ */
+static int parallel_next_job(struct parallel_run_t *run, uint32_t *job) {
+	int found = 0;
+
+#if defined(LINUX) || defined(__APPLE__)
+	pthread_mutex_lock(&run->lock);
+#else
+	EnterCriticalSection(&run->lock);
+#endif
+	if (run->next < run->jobs) {
+		*job = run->next;
+		run->next += 1;
+		found = 1;
+	}
+#if defined(LINUX) || defined(__APPLE__)
+	pthread_mutex_unlock(&run->lock);
+#else
+	LeaveCriticalSection(&run->lock);
+#endif
+
+	return found;
+}
+
+/**
+ * Thread body for run_parallel(), keeps taking jobs until they run out
+ */
+#if defined(LINUX) || defined(__APPLE__)
+static void *parallel_worker(void *arg) {
+#else
+static DWORD WINAPI parallel_worker(LPVOID arg) {
+#endif
+	struct parallel_run_t *run = (struct parallel_run_t *) arg;
+	uint32_t job;
+
+	while (parallel_next_job(run, &job)) {
+		run->fn(run->ctx, job);
+	}
+
+	return 0;
+}
+
+/**
+ * Runs a set of independent jobs on a pool of worker threads and waits for all of
+ * them to finish. With one thread (or one job) everything runs on the calling thread
+ */
+void run_parallel(parallel_job_t fn, void *ctx, uint32_t jobs, uint32_t threads) {
+	struct parallel_run_t run;
+	uint32_t i;
+#if defined(LINUX) || defined(__APPLE__)
+	pthread_t *workers;
+#else
+	HANDLE *workers;
+#endif
+
+	if (threads > jobs)
+		threads = jobs;
+
+	if (threads <= 1) {
+		for (i = 0; i < jobs; ++i) {
+			fn(ctx, i);
+		}
+		return;
+	}
+
+	run.fn = fn;
+	run.ctx = ctx;
+	run.jobs = jobs;
+	run.next = 0;
+
+#if defined(LINUX) || defined(__APPLE__)
+	pthread_mutex_init(&run.lock, NULL);
+	workers = (pthread_t *) calloc(threads, sizeof(pthread_t));
+	for (i = 0; i < threads; ++i) {
+		pthread_create(&workers[i], NULL, parallel_worker, &run);
+	}
+	for (i = 0; i < threads; ++i) {
+		pthread_join(workers[i], NULL);
+	}
+	pthread_mutex_destroy(&run.lock);
+#else
+	InitializeCriticalSection(&run.lock);
+	workers = (HANDLE *) calloc(threads, sizeof(HANDLE));
+	for (i = 0; i < threads; ++i) {
+		workers[i] = CreateThread(NULL, 0, parallel_worker, &run, 0, NULL);
+	}
+	for (i = 0; i < threads; ++i) {
+		WaitForSingleObject(workers[i], INFINITE);
+		CloseHandle(workers[i]);
+	}
+	DeleteCriticalSection(&run.lock);
+#endif
+
+	free(workers);
+}
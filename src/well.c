@@ -44,3 +44,30 @@ uint32_t well_1024a_bits(struct well_state_t *state, uint8_t bits) {
 	state->bits_left -= bits;
 	return rtn;
 }
+
+/**
+ * Derives an independent generator for a numbered sub-stream (i.e. a line block) from
+ * a base state, so that each sub-stream's random sequence does not depend on how many
+ * bits the other sub-streams consumed
+ * @param out State to initialize
+ * @param base Seed state shared by all sub-streams
+ * @param stream Index of the sub-stream
+ */
+void well_1024a_fork(struct well_state_t *out, const struct well_state_t *base, uint32_t stream) {
+	uint32_t i, z;
+
+	for (i = 0; i < 32; ++i) {
+		// Mix the stream and word index into the seed word (murmur3 finalizer)
+		z = base->state[i] ^ (stream * 0x9e3779b9u + i);
+		z ^= z >> 16;
+		z *= 0x85ebca6bu;
+		z ^= z >> 13;
+		z *= 0xc2b2ae35u;
+		z ^= z >> 16;
+		out->state[i] = z;
+	}
+
+	out->n = 0;
+	out->bit_output = 0;
+	out->bits_left = 0;
+}
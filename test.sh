@@ -7,3 +7,20 @@ make
 bin/qvz -u fref.txt -c 1 -f 0.5 -s test.in test.q > write
 bin/qvz -x test.q test.dec > read
 diff fref.txt test.dec
+
+# Ranges that end partway through a group of interleaved lanes
+bin/qvz -u lref.txt -c 1 -f 0.5 --coder rans --lanes 2 test.in test.lq > write
+bin/qvz -x --range 1:1 test.lq test.ldec > read
+sed -n 1,1p lref.txt | diff - test.ldec
+bin/qvz -x --range 7:9 test.lq test.ldec > read
+sed -n 7,9p lref.txt | diff - test.ldec
+bin/qvz -u lref.txt -c 1 -f 0.5 --coder tans --lanes 3 test.in test.lq > write
+bin/qvz -x --range 7:9 test.lq test.ldec > read
+sed -n 7,9p lref.txt | diff - test.ldec
+
+# Windowed encoding of many short reads (59 MB, 6.6M lines) must stay within --mem-limit
+awk 'BEGIN { srand(1); for (i = 0; i < 6600000; ++i) { s = ""; for (j = 0; j < 8; ++j) s = s sprintf("%c", 53 + int(rand()*20)); print s } }' > test.mem.in
+bin/qvz -v -u mref.txt -f 0.5 -t 4 --mem-limit 128 test.mem.in test.mq > write
+bin/qvz -x test.mq test.mdec > read
+diff mref.txt test.mdec
+awk '/^Peak resident memory:/ { print; exit !($4 <= 128) }' write